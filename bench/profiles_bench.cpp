@@ -0,0 +1,336 @@
+/*
+ * Micro-benchmarks for the extension's hot path: parsing `profiles -o
+ * stdout-xml` output, rendering payload content as JSON, and generating the
+ * rows of the `profiles` and `profile_items` tables.
+ *
+ * The extension is built into this binary (with its main() renamed), and run
+ * over generated fixtures - from 1 to 500 profiles, with large certificate
+ * payloads - or over captured `profiles -o stdout-xml` output given on the
+ * command line.  Nothing talks to osqueryd or reads the real profile store.
+ *
+ * Usage: profiles_bench [captured.xml ...]
+ */
+
+#define main osquery_profiles_main
+#include "../osquery_profiles.cpp"
+#undef main
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+
+/*
+ * Every allocation made by the process is counted, so that each benchmark can
+ * report how many allocations one iteration makes.
+ */
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+
+namespace {
+
+struct Fixture {
+  std::string name;
+  std::string xml;
+  size_t profiles;
+};
+
+
+/*
+ * Base64-encodes `size` bytes of pseudo-random data, wrapped the way plists
+ * wrap <data> values.
+ */
+std::string certificateData(size_t size, unsigned seed) {
+  static const char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  std::string data;
+  data.reserve(size * 4 / 3 + size / 39 + 16);
+  for (size_t i = 0; i < size * 4 / 3; i++) {
+    seed = seed * 1103515245 + 12345;
+    data.push_back(kAlphabet[(seed >> 16) & 63]);
+    if (i % 52 == 51) {
+      data.append("\n\t\t\t\t\t");
+    }
+  }
+  return data;
+}
+
+
+/*
+ * Builds `profiles -o stdout-xml` output with the given number of system-wide
+ * profiles, each with a Wi-Fi payload, a certificate payload with `certSize`
+ * bytes of data, and a custom settings payload.
+ */
+Fixture makeFixture(size_t profiles, size_t certSize) {
+  std::string xml =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+      "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+      "<plist version=\"1.0\">\n<dict>\n\t<key>_computerlevel</key>\n\t<array>\n";
+
+  for (size_t i = 0; i < profiles; i++) {
+    const auto id = std::to_string(i);
+    xml +=
+        "\t\t<dict>\n"
+        "\t\t\t<key>ProfileDescription</key>\n\t\t\t<string>Benchmark profile " + id + " &amp; friends</string>\n"
+        "\t\t\t<key>ProfileDisplayName</key>\n\t\t\t<string>Profile " + id + "</string>\n"
+        "\t\t\t<key>ProfileIdentifier</key>\n\t\t\t<string>com.example.bench." + id + "</string>\n"
+        "\t\t\t<key>ProfileInstallDate</key>\n\t\t\t<date>2016-08-10T17:43:39Z</date>\n"
+        "\t\t\t<key>ProfileOrganization</key>\n\t\t\t<string>Example Corp</string>\n"
+        "\t\t\t<key>ProfileRemovalDisallowed</key>\n\t\t\t<" + std::string(i % 2 ? "true" : "false") + "/>\n"
+        "\t\t\t<key>ProfileType</key>\n\t\t\t<string>Configuration</string>\n"
+        "\t\t\t<key>ProfileUUID</key>\n\t\t\t<string>29998254-A289-4F30-B59C-A8CE1A9F" + id + "</string>\n"
+        "\t\t\t<key>ProfileVerificationState</key>\n\t\t\t<string>verified</string>\n"
+        "\t\t\t<key>ProfileVersion</key>\n\t\t\t<integer>1</integer>\n"
+        "\t\t\t<key>ProfileItems</key>\n\t\t\t<array>\n"
+        "\t\t\t\t<dict>\n"
+        "\t\t\t\t\t<key>PayloadContent</key>\n\t\t\t\t\t<dict>\n"
+        "\t\t\t\t\t\t<key>AutoJoin</key><true/>\n"
+        "\t\t\t\t\t\t<key>EncryptionType</key><string>WPA2</string>\n"
+        "\t\t\t\t\t\t<key>SSID_STR</key><string>Example Wi-Fi " + id + "</string>\n"
+        "\t\t\t\t\t</dict>\n"
+        "\t\t\t\t\t<key>PayloadDisplayName</key>\n\t\t\t\t\t<string>Wi-Fi</string>\n"
+        "\t\t\t\t\t<key>PayloadIdentifier</key>\n\t\t\t\t\t<string>com.example.bench." + id + ".wifi</string>\n"
+        "\t\t\t\t\t<key>PayloadType</key>\n\t\t\t\t\t<string>com.apple.wifi.managed</string>\n"
+        "\t\t\t\t</dict>\n"
+        "\t\t\t\t<dict>\n"
+        "\t\t\t\t\t<key>PayloadContent</key>\n\t\t\t\t\t<data>\n\t\t\t\t\t" +
+        certificateData(certSize, static_cast<unsigned>(i)) + "\n\t\t\t\t\t</data>\n"
+        "\t\t\t\t\t<key>PayloadDisplayName</key>\n\t\t\t\t\t<string>Root CA</string>\n"
+        "\t\t\t\t\t<key>PayloadIdentifier</key>\n\t\t\t\t\t<string>com.example.bench." + id + ".cert</string>\n"
+        "\t\t\t\t\t<key>PayloadType</key>\n\t\t\t\t\t<string>com.apple.security.root</string>\n"
+        "\t\t\t\t</dict>\n"
+        "\t\t\t\t<dict>\n"
+        "\t\t\t\t\t<key>PayloadContent</key>\n\t\t\t\t\t<dict>\n"
+        "\t\t\t\t\t\t<key>com.example.app</key>\n\t\t\t\t\t\t<dict>\n"
+        "\t\t\t\t\t\t\t<key>Forced</key>\n\t\t\t\t\t\t\t<array>\n"
+        "\t\t\t\t\t\t\t\t<dict>\n"
+        "\t\t\t\t\t\t\t\t\t<key>mcx_preference_settings</key>\n\t\t\t\t\t\t\t\t\t<dict>\n"
+        "\t\t\t\t\t\t\t\t\t\t<key>Interval</key><integer>" + id + "</integer>\n"
+        "\t\t\t\t\t\t\t\t\t\t<key>Ratio</key><real>0.75</real>\n"
+        "\t\t\t\t\t\t\t\t\t\t<key>Server</key><string>https://mdm.example.com/</string>\n"
+        "\t\t\t\t\t\t\t\t\t\t<key>Tags</key><array><string>a</string><string>b</string></array>\n"
+        "\t\t\t\t\t\t\t\t\t</dict>\n"
+        "\t\t\t\t\t\t\t\t</dict>\n"
+        "\t\t\t\t\t\t\t</array>\n"
+        "\t\t\t\t\t\t</dict>\n"
+        "\t\t\t\t\t</dict>\n"
+        "\t\t\t\t\t<key>PayloadDisplayName</key>\n\t\t\t\t\t<string>Custom Settings</string>\n"
+        "\t\t\t\t\t<key>PayloadIdentifier</key>\n\t\t\t\t\t<string>com.example.bench." + id + ".settings</string>\n"
+        "\t\t\t\t\t<key>PayloadType</key>\n\t\t\t\t\t<string>com.apple.ManagedClient.preferences</string>\n"
+        "\t\t\t\t</dict>\n"
+        "\t\t\t</array>\n"
+        "\t\t</dict>\n";
+  }
+
+  xml += "\t</array>\n</dict>\n</plist>\n";
+
+  return Fixture{std::to_string(profiles) + " profiles, " + std::to_string(certSize / 1024) + "KiB certs",
+                 std::move(xml), profiles};
+}
+
+
+/*
+ * Runs `fn` repeatedly (for at least kMinIterations and kMinTime) and prints
+ * its latency percentiles, throughput and allocations per iteration.
+ */
+template<typename Fn>
+void measure(const std::string& name, size_t itemsPerIteration, size_t bytesPerIteration, Fn fn) {
+  static const size_t kMinIterations = 10;
+  static const auto kMinTime = std::chrono::milliseconds(500);
+
+  // Once to warm up caches.
+  fn();
+
+  std::vector<double> latencies;
+  const auto allocationsBefore = allocations.load();
+  const auto start = std::chrono::steady_clock::now();
+  while (latencies.size() < kMinIterations || std::chrono::steady_clock::now() - start < kMinTime) {
+    const auto before = std::chrono::steady_clock::now();
+    fn();
+    latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+  }
+  const auto iterations = latencies.size();
+  const auto perIteration = (allocations.load() - allocationsBefore) / iterations;
+
+  double total = 0;
+  for (const auto latency : latencies) {
+    total += latency;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  const auto p50 = latencies[iterations / 2];
+  const auto p99 = latencies[std::min(iterations - 1, iterations * 99 / 100)];
+  const auto seconds = total / 1e6;
+
+  std::printf("  %-22s %8zu iters  p50 %10.1fus  p99 %10.1fus  %10.0f items/s",
+              name.c_str(), iterations, p50, p99, itemsPerIteration * iterations / seconds);
+  if (bytesPerIteration > 0) {
+    std::printf("  %8.1f MB/s", bytesPerIteration * iterations / seconds / 1e6);
+  }
+  std::printf("  %8llu allocs/iter\n", static_cast<unsigned long long>(perIteration));
+}
+
+
+/*
+ * Builds the JSON context that osqueryd sends with a generate request, with
+ * an EQUALS constraint on `column` for each of the given values.
+ */
+std::string requestContext(const std::string& column, const std::vector<std::string>& values) {
+  std::string context = "{\"constraints\":[";
+  if (!values.empty()) {
+    context += "{\"name\":\"" + column + "\",\"affinity\":\"TEXT\",\"list\":[";
+    for (size_t i = 0; i < values.size(); i++) {
+      context += (i > 0 ? "," : "");
+      context += "{\"op\":" + std::to_string(EQUALS) + ",\"expr\":\"" + values[i] + "\"}";
+    }
+    context += "]}";
+  }
+  return context + "]}";
+}
+
+
+void runFixture(const Fixture& fixture) {
+  std::printf("%s (%.1f MB)\n", fixture.name.c_str(), fixture.xml.size() / 1e6);
+
+  // Parsing, at each level of detail.
+  const std::pair<const char*, ProfileDetail> details[] = {
+    {"parse (profile)", ProfileDetail::PROFILE},
+    {"parse (items)", ProfileDetail::ITEMS},
+    {"parse (content)", ProfileDetail::CONTENT},
+  };
+  for (const auto& it : details) {
+    measure(it.first, fixture.profiles, fixture.xml.size(), [&]() {
+      size_t count = 0;
+      parseProfile(fixture.xml, "", it.second, [&count](const std::string&, PlistTree&) {
+        count++;
+      });
+    });
+  }
+
+  auto entry = std::make_shared<ProfileCache::Entry>();
+  ProfileColumnsBuilder builder;
+  entry->status = parseProfile(fixture.xml, "", ProfileDetail::CONTENT, [&builder](const std::string&, PlistTree& profile) {
+    builder.add(profile);
+  });
+  entry->columns = builder.finish();
+  entry->fetched = std::chrono::steady_clock::now();
+  entry->detail = ProfileDetail::CONTENT;
+
+  // Rendering every payload's content, once it has been decoded.
+  const auto& columns = entry->columns;
+  std::vector<PlistTree> contents;
+  std::vector<std::string> identifiers;
+  for (size_t i = 0; i < columns.profiles(); i++) {
+    identifiers.push_back(columns.str(columns.identifier[i]));
+    for (auto payload = columns.payloadsBegin[i]; payload < columns.payloadsBegin[i + 1]; payload++) {
+      PlistTree content;
+      if (columns.content(payload, content)) {
+        contents.push_back(std::move(content));
+      }
+    }
+  }
+  measure("render content", contents.size(), 0, [&]() {
+    for (const auto& content : contents) {
+      renderContent(content);
+    }
+  });
+
+  // Both tables, through the same entry point osqueryd uses.  The entry is
+  // cached so that this measures row building rather than collection.
+  ProfileCache::instance().invalidateAll();
+  ProfileCache::instance().put("_computerlevel", entry);
+
+  ProfilesTablePlugin profiles;
+  PluginRequest profilesRequest = {{"action", "generate"}, {"context", requestContext("", {})}};
+  measure("profiles", fixture.profiles, 0, [&]() {
+    PluginResponse response;
+    profiles.call(profilesRequest, response);
+  });
+
+  ProfileItemsTablePlugin items;
+  PluginRequest itemsRequest = {{"action", "generate"},
+                                {"context", requestContext("profile_identifier", identifiers)}};
+  measure("profile_items", contents.size(), 0, [&]() {
+    PluginResponse response;
+    items.call(itemsRequest, response);
+  });
+
+  // Every content is decoded and rendered again: the cache is emptied of what
+  // the run above rendered, and nothing new is kept.
+  const auto contentCacheSize = FLAGS_profiles_content_cache_size;
+  FLAGS_profiles_content_cache_size = 0;
+  measure("profile_items (cold)", contents.size(), 0, [&]() {
+    ContentCache::instance().clear();
+    PluginResponse response;
+    items.call(itemsRequest, response);
+  });
+  FLAGS_profiles_content_cache_size = contentCacheSize;
+
+  std::printf("\n");
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  // Keep the fixture cached for as long as the benchmarks run.
+  FLAGS_profiles_cache_ttl = 24 * 60 * 60;
+
+  std::vector<Fixture> fixtures;
+  for (int i = 1; i < argc; i++) {
+    std::ifstream in(argv[i], std::ios::in | std::ios::binary);
+    if (!in) {
+      std::fprintf(stderr, "couldn't read %s\n", argv[i]);
+      return 1;
+    }
+
+    std::string xml((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t count = 0;
+    parseProfile(xml, "", ProfileDetail::PROFILE, [&count](const std::string&, PlistTree&) {
+      count++;
+    });
+    fixtures.push_back(Fixture{argv[i], std::move(xml), count});
+  }
+
+  if (fixtures.empty()) {
+    for (const size_t count : {1, 10, 100, 500}) {
+      fixtures.push_back(makeFixture(count, 2 * 1024));
+    }
+    fixtures.push_back(makeFixture(100, 64 * 1024));
+  }
+
+  for (const auto& fixture : fixtures) {
+    runFixture(fixture);
+  }
+  return 0;
+}
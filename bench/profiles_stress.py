@@ -0,0 +1,226 @@
+#!/usr/bin/env python
+
+from __future__ import print_function
+
+import argparse
+import random
+import subprocess
+import threading
+import time
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
+import osquery
+
+# This file is a load test for the extension.  Like query.py, it connects to
+# a running osquery process over its extension socket, and then fires bursts
+# of concurrent queries against `profiles` and `profile_items` - with a mix of
+# `username` and `profile_identifier` constraints - the way a fleet-wide
+# distributed query would.  While that runs, it samples the extension's RSS
+# and the number of running `profiles` processes, and at the end prints the
+# latency distribution of each kind of query along with the extension's own
+# counters.
+#
+# Start osqueryd with the extension first (e.g. `make run-osqueryd`).
+
+
+def percentile(values, fraction):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    index = min(len(values) - 1, int(fraction * len(values)))
+    return values[index]
+
+
+def run_query(client, query):
+    results = client.extension_client().query(query)
+    if results.status.code != 0:
+        raise RuntimeError(results.status.message)
+    return results.response
+
+
+def quoted(value):
+    return "'" + value.replace("'", "''") + "'"
+
+
+def extension_stats(client):
+    stats = {}
+    for row in run_query(client, "SELECT * FROM profiles_extension_stats;"):
+        stats[row["name"]] = int(row["value"])
+    return stats
+
+
+class Workload(object):
+    def __init__(self, client):
+        self.usernames = [row["username"] for row in run_query(
+            client, "SELECT username FROM users WHERE uid >= 500 LIMIT 20;")]
+        self.identifiers = [row["identifier"] for row in run_query(
+            client, "SELECT DISTINCT identifier FROM profiles;")]
+
+        # Some lookups should miss, as they would across a fleet.
+        self.usernames.append("no-such-user")
+        self.identifiers.append("no.such.profile")
+
+    def next(self):
+        username = random.choice(self.usernames)
+        identifier = random.choice(self.identifiers)
+        kinds = [
+            ("profiles", "SELECT * FROM profiles;"),
+            ("profiles by username",
+             "SELECT * FROM profiles WHERE username = %s;" % quoted(username)),
+            ("profile_items",
+             "SELECT * FROM profile_items WHERE profile_identifier = %s;" %
+             quoted(identifier)),
+            ("profile_items by username",
+             "SELECT identifier, content_hash FROM profile_items "
+             "WHERE profile_identifier = %s AND username = %s;" %
+             (quoted(identifier), quoted(username))),
+            ("profiles join profile_items",
+             "SELECT p.identifier, i.type FROM profiles p "
+             "JOIN profile_items i ON i.profile_identifier = p.identifier;"),
+        ]
+        return random.choice(kinds)
+
+
+class Sampler(threading.Thread):
+    def __init__(self, interval):
+        super(Sampler, self).__init__()
+        self.daemon = True
+        self.interval = interval
+        self.samples = []
+        self.stopped = threading.Event()
+
+    def run(self):
+        start = time.time()
+        while not self.stopped.is_set():
+            self.samples.append((time.time() - start, self.rss(), self.subprocesses()))
+            self.stopped.wait(self.interval)
+
+    @staticmethod
+    def pids(*args):
+        try:
+            output = subprocess.check_output(["pgrep"] + list(args))
+        except subprocess.CalledProcessError:
+            return []
+        return output.split()
+
+    def rss(self):
+        pids = self.pids("-f", "osquery_profiles.ext")
+        if not pids:
+            return 0
+        output = subprocess.check_output(["ps", "-o", "rss=", "-p", pids[0]])
+        return int(output.strip() or 0)
+
+    def subprocesses(self):
+        return len(self.pids("-x", "profiles"))
+
+
+def worker(path, jobs, results):
+    client = osquery.ExtensionClient(path=path)
+    client.open()
+    while True:
+        job = jobs.get()
+        if job is None:
+            jobs.task_done()
+            return
+
+        kind, query = job
+        start = time.time()
+        try:
+            run_query(client, query)
+            results.append((kind, time.time() - start, None))
+        except Exception as e:
+            results.append((kind, time.time() - start, str(e)))
+        jobs.task_done()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test the profiles extension")
+    parser.add_argument("--socket", default="/tmp/osquery.ext.sock")
+    parser.add_argument("--clients", type=int, default=200,
+                        help="concurrent connections, and queries per burst")
+    parser.add_argument("--bursts", type=int, default=20)
+    parser.add_argument("--interval", type=float, default=2.0,
+                        help="seconds between the start of each burst")
+    parser.add_argument("--sample-interval", type=float, default=0.5)
+    parser.add_argument("--samples-csv", help="write RSS and subprocess samples here")
+    args = parser.parse_args()
+
+    client = osquery.ExtensionClient(path=args.socket)
+    client.open()
+    workload = Workload(client)
+    before = extension_stats(client)
+
+    jobs = queue.Queue()
+    results = []
+    workers = []
+    for _ in range(args.clients):
+        t = threading.Thread(target=worker, args=(args.socket, jobs, results))
+        t.daemon = True
+        t.start()
+        workers.append(t)
+
+    sampler = Sampler(args.sample_interval)
+    sampler.start()
+
+    start = time.time()
+    for burst in range(args.bursts):
+        burst_start = time.time()
+        for _ in range(args.clients):
+            jobs.put(workload.next())
+        jobs.join()
+
+        elapsed = time.time() - burst_start
+        print("burst %d/%d: %.0f ms" % (burst + 1, args.bursts, elapsed * 1000))
+        if elapsed < args.interval:
+            time.sleep(args.interval - elapsed)
+    total = time.time() - start
+
+    for _ in workers:
+        jobs.put(None)
+    jobs.join()
+    sampler.stopped.set()
+    sampler.join()
+
+    after = extension_stats(client)
+
+    print()
+    print("%-30s %7s %7s %9s %9s %9s %9s" %
+          ("query", "count", "errors", "p50 ms", "p90 ms", "p99 ms", "max ms"))
+    kinds = sorted(set(kind for kind, _, _ in results))
+    for kind in kinds + ["all"]:
+        latencies = [l * 1000 for k, l, _ in results if kind in (k, "all")]
+        errors = len([e for k, _, e in results if kind in (k, "all") and e])
+        print("%-30s %7d %7d %9.1f %9.1f %9.1f %9.1f" % (
+            kind, len(latencies), errors, percentile(latencies, 0.5),
+            percentile(latencies, 0.9), percentile(latencies, 0.99),
+            max(latencies) if latencies else 0.0))
+    print("%.1f queries/s over %.1f s" % (len(results) / total, total))
+
+    errors = sorted(set(e for _, _, e in results if e))
+    for error in errors[:5]:
+        print("error: %s" % error)
+
+    print()
+    rss = [s[1] for s in sampler.samples]
+    running = [s[2] for s in sampler.samples]
+    if sampler.samples:
+        print("extension RSS: start %d KiB, peak %d KiB, end %d KiB" %
+              (rss[0], max(rss), rss[-1]))
+        print("running `profiles` processes: peak %d" % max(running))
+    for name in sorted(after):
+        if after[name] != before.get(name, 0):
+            print("%-30s +%d" % (name, after[name] - before.get(name, 0)))
+
+    if args.samples_csv:
+        with open(args.samples_csv, "w") as f:
+            f.write("seconds,rss_kib,profiles_processes\n")
+            for sample in sampler.samples:
+                f.write("%.2f,%d,%d\n" % sample)
+
+
+if __name__ == "__main__":
+    main()
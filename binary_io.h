@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "plist_tree.h"
+
+
+/*
+ * This class appends values to a string in the compact binary encoding used
+ * by profile snapshots and payload content blobs: integers are unsigned
+ * LEB128 varints, strings are a length followed by bytes, and vectors are a
+ * count followed by their elements.  A tree is its value, type and child
+ * count, followed by the key and tree of every child.
+ */
+class BinaryWriter {
+ public:
+  explicit BinaryWriter(std::string& out) : out_(out) {}
+
+  void varint(uint64_t value) {
+    while (value >= 0x80) {
+      out_.push_back(static_cast<char>((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    out_.push_back(static_cast<char>(value));
+  }
+
+  void string(const std::string& value) {
+    varint(value.size());
+    out_.append(value);
+  }
+
+  template<typename T>
+  void integers(const std::vector<T>& values) {
+    varint(values.size());
+    for (const auto value : values) {
+      varint(static_cast<uint64_t>(value));
+    }
+  }
+
+  void strings(const std::vector<std::string>& values) {
+    varint(values.size());
+    for (const auto& value : values) {
+      string(value);
+    }
+  }
+
+  void tree(const PlistTree& node) {
+    string(node.data().value);
+    varint(static_cast<uint64_t>(node.data().type));
+    varint(node.size());
+    for (const auto& it : node) {
+      string(it.first);
+      tree(it.second);
+    }
+  }
+
+ private:
+  std::string& out_;
+};
+
+
+/*
+ * This class reads values written by BinaryWriter from a buffer.  Every
+ * method returns false (and leaves the reader in an unspecified position) if
+ * the buffer doesn't hold what was asked for.
+ */
+class BinaryReader {
+ public:
+  BinaryReader(const char* data, size_t size) : p_(data), end_(data + size) {}
+
+  bool varint(uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (p_ == end_) {
+        return false;
+      }
+      const auto byte = static_cast<unsigned char>(*p_++);
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool string(std::string& value) {
+    uint64_t size;
+    if (!varint(size) || size > remaining()) {
+      return false;
+    }
+    value.assign(p_, static_cast<size_t>(size));
+    p_ += size;
+    return true;
+  }
+
+  template<typename T>
+  bool integers(std::vector<T>& values) {
+    uint64_t count;
+    if (!varint(count) || count > remaining()) {
+      return false;
+    }
+    values.resize(static_cast<size_t>(count));
+    for (auto& value : values) {
+      uint64_t v;
+      if (!varint(v)) {
+        return false;
+      }
+      value = static_cast<T>(v);
+    }
+    return true;
+  }
+
+  bool strings(std::vector<std::string>& values) {
+    uint64_t count;
+    if (!varint(count) || count > remaining()) {
+      return false;
+    }
+    values.resize(static_cast<size_t>(count));
+    for (auto& value : values) {
+      if (!string(value)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool bytes(const char* expected, size_t size) {
+    if (remaining() < size || memcmp(p_, expected, size) != 0) {
+      return false;
+    }
+    p_ += size;
+    return true;
+  }
+
+  bool tree(PlistTree& node, unsigned depth = 0) {
+    // Plists aren't nested anywhere near this deep; this only guards against
+    // corrupt input recursing forever.
+    if (depth > 256) {
+      return false;
+    }
+
+    uint64_t type;
+    uint64_t children;
+    if (!string(node.data().value) || !varint(type) || type > static_cast<uint64_t>(PlistType::ARRAY) ||
+        !varint(children)) {
+      return false;
+    }
+    node.data().type = static_cast<PlistType>(type);
+
+    for (uint64_t i = 0; i < children; i++) {
+      std::string key;
+      if (!string(key)) {
+        return false;
+      }
+      auto& child = node.push_back(std::make_pair(std::move(key), PlistTree()))->second;
+      if (!tree(child, depth + 1)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool done() const {
+    return p_ == end_;
+  }
+
+ private:
+  size_t remaining() const {
+    return static_cast<size_t>(end_ - p_);
+  }
+
+  const char* p_;
+  const char* end_;
+};
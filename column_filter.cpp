@@ -0,0 +1,107 @@
+#include "column_filter.h"
+
+#include <cctype>
+#include <cstdlib>
+
+using namespace osquery;
+
+
+bool likeMatches(const std::string& pattern, const std::string& value) {
+  auto lower = [](unsigned char c) {
+    return (c < 0x80) ? static_cast<unsigned char>(tolower(c)) : c;
+  };
+  auto nextChar = [](const char* p) {
+    do {
+      p++;
+    } while ((*p & 0xC0) == 0x80);
+    return p;
+  };
+
+  const char* p = pattern.c_str();
+  const char* v = value.c_str();
+  const char* starP = nullptr;
+  const char* starV = nullptr;
+
+  while (*v != '\0') {
+    if (*p == '%') {
+      starP = ++p;
+      starV = v;
+    } else if (*p == '_') {
+      p++;
+      v = nextChar(v);
+    } else if (*p != '\0' && lower(*p) == lower(*v)) {
+      p++;
+      v++;
+    } else if (starP != nullptr) {
+      // Let the last '%' swallow one more character, and try again.
+      p = starP;
+      v = starV = nextChar(starV);
+    } else {
+      return false;
+    }
+  }
+
+  while (*p == '%') {
+    p++;
+  }
+  return *p == '\0';
+}
+
+
+ColumnFilter::ColumnFilter(QueryContext& request, std::initializer_list<std::string> columns) {
+  for (const auto& column : columns) {
+    auto equals = request.constraints[column].getAll(EQUALS);
+    auto likes = request.constraints[column].getAll(LIKE);
+    if (!equals.empty() || !likes.empty()) {
+      constraints_[column] = {std::move(equals), std::move(likes)};
+    }
+  }
+}
+
+
+bool ColumnFilter::matches(const std::string& column, const std::string& value) const {
+  auto it = constraints_.find(column);
+  if (it == constraints_.end()) {
+    return true;
+  }
+
+  const auto& equals = it->second.equals;
+  if (!equals.empty() && equals.count(value) == 0) {
+    return false;
+  }
+  for (const auto& expr : it->second.likes) {
+    if (!likeMatches(expr, value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool ColumnFilter::matches(const std::string& column, long long value) const {
+  auto it = constraints_.find(column);
+  if (it == constraints_.end()) {
+    return true;
+  }
+
+  const auto& equals = it->second.equals;
+  bool matched = equals.empty();
+  for (const auto& expr : equals) {
+    // Leave anything that isn't a plain integer (e.g. '1.0') to SQLite.
+    char* end = nullptr;
+    auto wanted = strtoll(expr.c_str(), &end, 10);
+    if (expr.empty() || *end != '\0' || wanted == value) {
+      matched = true;
+      break;
+    }
+  }
+  if (!matched) {
+    return false;
+  }
+  for (const auto& expr : it->second.likes) {
+    if (!likeMatches(expr, std::to_string(value))) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <initializer_list>
+#include <map>
+#include <set>
+#include <string>
+
+#include <osquery/tables.h>
+
+
+/*
+ * This function implements SQLite's built-in LIKE: '%' matches any run of
+ * characters, '_' matches any single (UTF-8) character, and ASCII letters
+ * match regardless of case.
+ */
+bool likeMatches(const std::string& pattern, const std::string& value);
+
+
+/*
+ * This class holds the EQUALS and LIKE constraints that a query has on some
+ * of a table's columns, so that we can skip profiles or payloads that can't
+ * match before building a row for them.  SQLite still checks every constraint
+ * itself afterwards, so this only ever needs to be a cheap first pass - but it
+ * must never reject a value that SQLite would accept.
+ *
+ * Several EQUALS values for a column are any-of, as everywhere else (osqueryd
+ * may pass an IN list as one request), while every LIKE pattern has to match.
+ */
+class ColumnFilter {
+ public:
+  ColumnFilter(osquery::QueryContext& request, std::initializer_list<std::string> columns);
+
+  bool matches(const std::string& column, const std::string& value) const;
+
+  // For an INTEGER column.  EQUALS values that aren't plain integers (e.g.
+  // '1.0') are left to SQLite, and so match anything.
+  bool matches(const std::string& column, long long value) const;
+
+ private:
+  struct Constraints {
+    std::set<std::string> equals;
+    std::set<std::string> likes;
+  };
+
+  std::map<std::string, Constraints> constraints_;
+};
@@ -0,0 +1,223 @@
+#include "json_encoder.h"
+
+#include <cstdint>
+#include <cstring>
+
+
+namespace {
+
+const char kHexDigits[] = "0123456789ABCDEF";
+
+// Whether the given byte has to be escaped.  This is the same set as
+// pt::write_json() escapes: control characters, '"', '/' and '\'.  Bytes above
+// 0x7F are copied through unchanged.
+inline bool needsEscape(unsigned char c) {
+  return c < 0x20 || c == '"' || c == '/' || c == '\\';
+}
+
+// Whether any of the 8 bytes in `word` has to be escaped.  This tests all of
+// them at once (using the usual "has a zero byte" trick), so that the long
+// runs of plain ASCII in certificates and the like are copied in bulk.
+inline bool wordNeedsEscape(uint64_t word) {
+  const uint64_t kOnes = 0x0101010101010101ULL;
+  const uint64_t kHighs = 0x8080808080808080ULL;
+
+  auto hasZero = [&](uint64_t v) { return (v - kOnes) & ~v & kHighs; };
+  auto hasByte = [&](unsigned char c) { return hasZero(word ^ (kOnes * c)); };
+
+  // Bytes below 0x20, ignoring those with the high bit set.
+  uint64_t control = (word - kOnes * 0x20) & ~word & kHighs;
+  return (control | hasByte('"') | hasByte('/') | hasByte('\\')) != 0;
+}
+
+void appendEscaped(std::string& out, const std::string& value) {
+  const char* data = value.data();
+  const size_t size = value.size();
+
+  size_t start = 0;
+  size_t i = 0;
+  while (i < size) {
+    if (i + 8 <= size) {
+      uint64_t word;
+      std::memcpy(&word, data + i, sizeof(word));
+      if (!wordNeedsEscape(word)) {
+        i += 8;
+        continue;
+      }
+    }
+
+    const auto c = static_cast<unsigned char>(data[i]);
+    if (!needsEscape(c)) {
+      ++i;
+      continue;
+    }
+
+    out.append(data + start, i - start);
+    switch (c) {
+    case '\b':
+      out.append("\\b", 2);
+      break;
+    case '\f':
+      out.append("\\f", 2);
+      break;
+    case '\n':
+      out.append("\\n", 2);
+      break;
+    case '\r':
+      out.append("\\r", 2);
+      break;
+    case '\t':
+      out.append("\\t", 2);
+      break;
+    case '"':
+      out.append("\\\"", 2);
+      break;
+    case '/':
+      out.append("\\/", 2);
+      break;
+    case '\\':
+      out.append("\\\\", 2);
+      break;
+    default:
+      out.append("\\u00", 4);
+      out.push_back(kHexDigits[c >> 4]);
+      out.push_back(kHexDigits[c & 0xF]);
+      break;
+    }
+
+    start = ++i;
+  }
+  out.append(data + start, size - start);
+}
+
+void appendString(std::string& out, const std::string& value) {
+  out.push_back('"');
+  appendEscaped(out, value);
+  out.push_back('"');
+}
+
+// Whether the given value is a valid JSON number.  Plist integers and reals
+// are almost always fine, but can also be e.g. "nan" or "+5".
+bool isJsonNumber(const std::string& value) {
+  size_t i = 0;
+  const size_t size = value.size();
+  auto digits = [&]() {
+    size_t begin = i;
+    while (i < size && value[i] >= '0' && value[i] <= '9') {
+      ++i;
+    }
+    return i > begin;
+  };
+
+  if (i < size && value[i] == '-') {
+    ++i;
+  }
+  if (i < size && value[i] == '0') {
+    ++i;
+  } else if (!digits()) {
+    return false;
+  }
+  if (i < size && value[i] == '.') {
+    ++i;
+    if (!digits()) {
+      return false;
+    }
+  }
+  if (i < size && (value[i] == 'e' || value[i] == 'E')) {
+    ++i;
+    if (i < size && (value[i] == '+' || value[i] == '-')) {
+      ++i;
+    }
+    if (!digits()) {
+      return false;
+    }
+  }
+  return i == size;
+}
+
+void appendValue(std::string& out, const PlistValue& value, bool typed) {
+  if (!typed) {
+    appendString(out, value.value);
+    return;
+  }
+
+  switch (value.type) {
+  case PlistType::DICT:
+    out.append("{}", 2);
+    break;
+  case PlistType::ARRAY:
+    out.append("[]", 2);
+    break;
+  case PlistType::BOOLEAN:
+    out.append(value.value == "true" ? "true" : "false");
+    break;
+  case PlistType::INTEGER:
+  case PlistType::REAL:
+  case PlistType::DATE:
+    if (isJsonNumber(value.value)) {
+      out.append(value.value);
+    } else {
+      appendString(out, value.value);
+    }
+    break;
+  default:
+    appendString(out, value.value);
+    break;
+  }
+}
+
+// This mirrors pt::write_json(): below the top level, a node is an array when
+// all of its children have empty keys, and an object otherwise.
+bool isArray(const PlistTree& tree) {
+  for (const auto& it : tree) {
+    if (!it.first.empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Roughly how long the encoding of `tree` will be, so that the output only
+// has to be allocated once.
+size_t estimateSize(const PlistTree& tree) {
+  size_t size = tree.data().value.size() + 2;
+  for (const auto& it : tree) {
+    size += it.first.size() + 4 + estimateSize(it.second);
+  }
+  return size;
+}
+
+void encode(const PlistTree& tree, bool typed, bool top, std::string& out) {
+  if (tree.empty() && !(top && tree.data().value.empty())) {
+    appendValue(out, tree.data(), typed);
+    return;
+  }
+
+  // Like pt::write_json(), the top level is always an object.
+  const bool array = top ? (typed && tree.data().type == PlistType::ARRAY) : isArray(tree);
+  out.push_back(array ? '[' : '{');
+
+  bool first = true;
+  for (const auto& it : tree) {
+    if (!first) {
+      out.push_back(',');
+    }
+    first = false;
+
+    if (!array) {
+      appendString(out, it.first);
+      out.push_back(':');
+    }
+    encode(it.second, typed, false, out);
+  }
+
+  out.push_back(array ? ']' : '}');
+}
+
+}  // namespace
+
+
+void encodeJson(const PlistTree& tree, bool typed, std::string& out) {
+  out.reserve(out.size() + estimateSize(tree));
+  encode(tree, typed, true, out);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+
+#include "plist_tree.h"
+
+
+/*
+ * This function appends the JSON encoding of the given tree to `out`.
+ *
+ * By default, the output is byte-for-byte what pt::write_json() writes in
+ * compact mode (without the trailing newline): the top level is an object,
+ * every value is a string, and empty dictionaries and arrays are written as "".
+ * The one difference is that a top-level value (e.g. a PayloadContent that is
+ * just data) is written as a string, where pt::write_json() throws.
+ *
+ * With `typed`, integers, reals, booleans and dates are written as JSON
+ * numbers and booleans instead, empty dictionaries and arrays as {} and [], and
+ * a top-level array as an array.
+ */
+void encodeJson(const PlistTree& tree, bool typed, std::string& out);
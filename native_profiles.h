@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+#include <osquery/status.h>
+
+#include "plist_tree.h"
+
+
+/*
+ * This function reads the on-disk configuration profile store directly,
+ * without running `/usr/bin/profiles`.
+ *
+ * The resulting tree has the same shape as the output of `profiles -P`: the
+ * root keys are usernames (or "_computerlevel"), each holding a list of
+ * profiles, and values are converted the same way as by osquery's
+ * parsePlistContent().
+ */
+osquery::Status readProfileStore(const std::string& path, PlistTree& tree);
@@ -0,0 +1,78 @@
+#import <Foundation/Foundation.h>
+
+#include "native_profiles.h"
+
+using namespace osquery;
+
+
+/*
+ * This helper function converts the given plist value, and everything under
+ * it, into the given tree node.  Dictionaries and arrays become child nodes
+ * (arrays with empty keys), and everything else becomes the node's value.
+ */
+static void convertValue(id value, PlistTree& node) {
+  auto& data = node.data();
+
+  if ([value isKindOfClass:[NSDictionary class]]) {
+    data.type = PlistType::DICT;
+
+    // Keys are added in sorted order, as `profiles -o stdout-xml` writes them,
+    // rather than in the dictionary's hash order.
+    NSDictionary* dict = (NSDictionary*)value;
+    NSArray* keys = [[dict allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    for (id key in keys) {
+      PlistTree child;
+      convertValue([dict objectForKey:key], child);
+
+      const char* name = [[key description] UTF8String];
+      node.push_back(std::make_pair(std::string(name ? name : ""), std::move(child)));
+    }
+  } else if ([value isKindOfClass:[NSArray class]]) {
+    data.type = PlistType::ARRAY;
+
+    for (id item in (NSArray*)value) {
+      PlistTree child;
+      convertValue(item, child);
+      node.push_back(std::make_pair(std::string(), std::move(child)));
+    }
+  } else if ([value isKindOfClass:[NSString class]]) {
+    const char* str = [(NSString*)value UTF8String];
+    data.value = str ? str : "";
+    data.type = PlistType::STRING;
+  } else if ([value isKindOfClass:[NSNumber class]]) {
+    // Booleans are also NSNumbers, but are rendered as "true" / "false".
+    if (CFGetTypeID((CFTypeRef)value) == CFBooleanGetTypeID()) {
+      data.value = [value boolValue] ? "true" : "false";
+      data.type = PlistType::BOOLEAN;
+    } else {
+      data.value = [[value stringValue] UTF8String];
+      data.type = CFNumberIsFloatType((CFNumberRef)value) ? PlistType::REAL : PlistType::INTEGER;
+    }
+  } else if ([value isKindOfClass:[NSDate class]]) {
+    auto seconds = static_cast<long long>([(NSDate*)value timeIntervalSince1970]);
+    data.value = std::to_string(seconds);
+    data.type = PlistType::DATE;
+  } else if ([value isKindOfClass:[NSData class]]) {
+    NSString* encoded = [(NSData*)value base64EncodedStringWithOptions:0];
+    data.value = [encoded UTF8String];
+    data.type = PlistType::DATA;
+  }
+}
+
+
+Status readProfileStore(const std::string& path, PlistTree& tree) {
+  @autoreleasepool {
+    NSString* storePath = [NSString stringWithUTF8String:path.c_str()];
+
+    // This handles both binary and XML plists.
+    NSDictionary* store = [NSDictionary dictionaryWithContentsOfFile:storePath];
+    if (store == nil) {
+      return Status(1, "Could not read profile store: " + path);
+    }
+
+    tree.clear();
+    convertValue(store, tree);
+  }
+
+  return Status(0, "OK");
+}
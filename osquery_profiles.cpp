@@ -1,66 +1,232 @@
+#include <osquery/dispatcher.h>
+#include <osquery/flags.h>
 #include <osquery/sdk.h>
 #include <osquery/system.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
-#include <iomanip>
-#include <sstream>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <unistd.h>
-#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/event.h>
+#include <sys/wait.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/filesystem.hpp>
-#include <boost/property_tree/json_parser.hpp>
+
+#include "column_filter.h"
+#include "json_encoder.h"
+#include "native_profiles.h"
+#include "plist_stream.h"
+#include "profile_columns.h"
+#include "profile_snapshot.h"
 
 
 using namespace osquery;
 namespace fs = boost::filesystem;
-namespace pt = boost::property_tree;
-
 
-template<typename T>
-using deleted_unique_ptr = std::unique_ptr<T,std::function<void(T*)>>;
+extern char **environ;
+
+
+FLAG(uint64,
+     profiles_cache_ttl,
+     60,
+     "Seconds to cache the parsed output of /usr/bin/profiles (0 to disable)");
+
+FLAG(uint64,
+     profiles_query_window_ms,
+     2000,
+     "Milliseconds for which one collection answers repeated calls from the "
+     "same query (e.g. a join against profile_items), even with caching disabled");
+
+FLAG(bool,
+     profiles_watch_store,
+     true,
+     "Invalidate the profiles cache when the on-disk profile store changes");
+
+FLAG(string,
+     profiles_capture_mode,
+     "pipe",
+     "How to capture /usr/bin/profiles output: 'pipe' or 'tempfile'");
+
+FLAG(uint64,
+     profiles_command_timeout,
+     30,
+     "Seconds before a /usr/bin/profiles run is killed (0 for no limit)");
+
+FLAG(bool,
+     profiles_serve_stale,
+     true,
+     "Answer from expired cached profiles when /usr/bin/profiles fails or times out");
+
+FLAG(uint64,
+     profiles_users_cache_ttl,
+     60,
+     "Seconds to cache lookups against the users table (0 to disable)");
+
+FLAG(uint64,
+     profiles_content_cache_size,
+     4096,
+     "Maximum number of rendered payload contents to keep cached (0 to disable)");
+
+FLAG(uint64,
+     profiles_refresh_interval,
+     0,
+     "Seconds between background refreshes of the profiles cache, so that "
+     "queries are answered without running /usr/bin/profiles (0 to disable)");
+
+FLAG(uint64,
+     profiles_refresh_max_interval,
+     300,
+     "Seconds that background refreshes back off to while the profile store is "
+     "watched and the profiles don't change (at most doubling each time), and "
+     "the longest a cached entry is served for while the store is watched");
+
+FLAG(bool,
+     profiles_typed_content,
+     false,
+     "Render numbers and booleans in profile_items.content as JSON numbers and "
+     "booleans, rather than as strings");
+
+FLAG(uint64,
+     profiles_collection_threads,
+     4,
+     "Maximum number of users whose profiles are collected concurrently");
+
+FLAG(string,
+     profiles_collection_mode,
+     "auto",
+     "How to collect profiles: 'scope' (run /usr/bin/profiles once per user), "
+     "'bulk' (once for all users, requires root), 'native' (read the profile "
+     "store directly, falling back to bulk) or 'auto' (bulk when running as "
+     "root, otherwise scope)");
+
+FLAG(uint64,
+     profiles_changes_history,
+     1000,
+     "Number of profile changes kept for the profile_changes table");
+
+FLAG(string,
+     profiles_snapshot_path,
+     "",
+     "Path to save the last collected profiles to, so that they can be served "
+     "straight away after a restart while being revalidated (empty to disable)");
+
+FLAG(string,
+     profiles_store_path,
+     "/var/db/ConfigurationProfiles/Store/ConfigProfiles.binary",
+     "Path to the configuration profile store used by native collection");
 
 
 /*
- * This is a helper function that mimics the closefrom() function in
- * FreeBSD/OpenBSD.
+ * This class keeps counters and timers for the extension's hot path, which
+ * are reported by the `profiles_extension_stats` table.  Timers are totals in
+ * microseconds.
  */
-void closeFrom(int lowfd) {
-  deleted_unique_ptr<DIR> dirp(opendir("/dev/fd"), [](DIR *d) { closedir(d); });
-  if (dirp == nullptr) {
-    return;
+class ExtensionStats {
+ public:
+  enum Counter {
+    COMMANDS_RUN,
+    COMMAND_FAILURES,
+    COMMAND_TIMEOUTS,
+    COMMAND_SPAWN_US,
+    COMMAND_US,
+    BYTES_CAPTURED,
+    STORE_READS,
+    STORE_READ_US,
+    PARSES,
+    PARSE_US,
+    CACHE_HITS,
+    CACHE_MISSES,
+    STALE_HITS,
+    COALESCED_COLLECTIONS,
+    SNAPSHOT_SAVES,
+    SNAPSHOT_LOAD_AGE_S,
+    ROWS_PROFILES,
+    ROWS_PROFILE_ITEMS,
+    ROWS_PROFILE_CHANGES,
+    NUM_COUNTERS,
+  };
+
+  static void add(Counter counter, uint64_t amount = 1) {
+    counters()[counter].fetch_add(amount, std::memory_order_relaxed);
   }
 
-  struct dirent *dent;
-  while ((dent = readdir(dirp.get())) != nullptr) {
-    std::string dirname(dent->d_name);
+  static uint64_t get(Counter counter) {
+    return counters()[counter].load(std::memory_order_relaxed);
+  }
 
-    int fd;
-    try {
-      fd = std::stoi(dirname);
-    } catch (const std::invalid_argument &) {
-      continue;
-    } catch (const std::out_of_range &) {
-      continue;
-    }
+  static const char* name(Counter counter) {
+    static const char* const kNames[NUM_COUNTERS] = {
+      "commands_run",
+      "command_failures",
+      "command_timeouts",
+      "command_spawn_us",
+      "command_us",
+      "bytes_captured",
+      "store_reads",
+      "store_read_us",
+      "parses",
+      "parse_us",
+      "cache_hits",
+      "cache_misses",
+      "stale_hits",
+      "coalesced_collections",
+      "snapshot_saves",
+      "snapshot_load_age_s",
+      "rows_profiles",
+      "rows_profile_items",
+      "rows_profile_changes",
+    };
+    return kNames[counter];
+  }
 
-    if (fd >= 0 && fd < INT_MAX && fd >= lowfd && fd != dirfd(dirp.get())) {
-      close(fd);
-    }
+ private:
+  static std::atomic<uint64_t>* counters() {
+    static std::atomic<uint64_t> values[NUM_COUNTERS] = {};
+    return values;
   }
+};
 
-  return;
-}
+
+/*
+ * This class adds the time from its construction to its destruction to the
+ * given timer.
+ */
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(ExtensionStats::Counter timer)
+      : timer_(timer), start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedTimer() {
+    const auto elapsed = std::chrono::steady_clock::now() - start_;
+    ExtensionStats::add(timer_, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  }
+
+ private:
+  ExtensionStats::Counter timer_;
+  std::chrono::steady_clock::time_point start_;
+};
 
 
 /*
- * This is a helper function to run a subprocess and capture the output.
+ * Make a NULL-terminated char* array for passing the given command to exec.
+ * The returned pointers are only valid as long as the command is.
  */
-Status runCommand(const std::vector<std::string>& command, std::string& output) {
-  // Make char* array for arguments.  Don't forget to NULL-terminate!
+std::vector<char*> commandArguments(const std::vector<std::string>& command) {
   std::vector<char*> arguments;
   std::transform(command.begin(), command.end(),
                  std::back_inserter(arguments),
@@ -68,184 +234,1835 @@ Status runCommand(const std::vector<std::string>& command, std::string& output)
     return const_cast<char*>(one.c_str());
   });
   arguments.push_back(nullptr);
+  return arguments;
+}
+
+
+/*
+ * This helper function starts the given command with its stdout and stderr
+ * sent to `outputFd`, which is closed in the child, and its stdin reading from
+ * /dev/null.  Every other FD is closed by exec (e.g. the extension socket), so
+ * nothing has to be done in the child between fork and exec.  It returns 0 or
+ * the error from posix_spawn().
+ */
+int spawnCommand(std::vector<char*>& arguments, int outputFd, pid_t& p) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, outputFd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, outputFd, STDERR_FILENO);
+
+  // With POSIX_SPAWN_CLOEXEC_DEFAULT, stdin would be closed too, and the first
+  // file the child opened would become its stdin.
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+  // If `outputFd` is one of the standard streams, it has just been replaced
+  // (or duplicated onto itself) and mustn't be closed.
+  if (outputFd > STDERR_FILENO) {
+    posix_spawn_file_actions_addclose(&actions, outputFd);
+  }
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+  // Don't leak any of our other FDs to the child, whether or not they were
+  // opened with O_CLOEXEC.
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+#endif
+
+  int err;
+  {
+    ScopedTimer timer(ExtensionStats::COMMAND_SPAWN_US);
+    err = posix_spawn(&p, arguments[0], &actions, &attr, &arguments[0], environ);
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return err;
+}
+
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+// How long a subprocess gets to exit after SIGTERM, before it's sent SIGKILL.
+const auto kTerminateGrace = std::chrono::seconds(2);
+
+// Set when all running subprocesses should be given up on (e.g. on shutdown).
+std::atomic<bool> commandsCancelled{false};
+
+
+/*
+ * This helper function makes every running (and future) subprocess be given
+ * up on as if it had timed out.
+ */
+void cancelCommands() {
+  commandsCancelled = true;
+}
+
+
+/*
+ * This helper function returns the deadline for a subprocess started now, as
+ * per --profiles_command_timeout.
+ */
+Deadline commandDeadline() {
+  if (FLAGS_profiles_command_timeout == 0) {
+    return Deadline::max();
+  }
+  return std::chrono::steady_clock::now() + std::chrono::seconds(FLAGS_profiles_command_timeout);
+}
+
+
+/*
+ * This helper function waits for the given subprocess to exit, and returns
+ * true once it has (along with its status), or false if the deadline passes
+ * or commands are cancelled first.
+ */
+bool waitForChild(pid_t p, Deadline deadline, int& status) {
+  while (true) {
+    pid_t r = waitpid(p, &status, WNOHANG);
+    if (r == p) {
+      return true;
+    }
+    if (r < 0 && errno != EINTR) {
+      status = -1;
+      return true;
+    }
+
+    if (commandsCancelled || std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+
+/*
+ * This helper function stops the given subprocess: first by asking it to exit
+ * with SIGTERM, and then with SIGKILL if it's still around after
+ * kTerminateGrace.  It always reaps the subprocess.
+ */
+void terminateChild(pid_t p) {
+  int status;
+
+  kill(p, SIGTERM);
+  if (waitForChild(p, std::chrono::steady_clock::now() + kTerminateGrace, status)) {
+    return;
+  }
+
+  kill(p, SIGKILL);
+  while (waitpid(p, &status, 0) == -1 && errno == EINTR) {
+  }
+}
+
+
+/*
+ * This is a helper function to run a subprocess and capture the output, by
+ * sending it to a temporary file and reading that back once it exits.
+ *
+ * If the subprocess hasn't finished by the deadline, it is terminated.
+ */
+Status runCommandTempFile(const std::vector<std::string>& command, std::string& output, Deadline deadline) {
+  auto arguments = commandArguments(command);
 
-  // Get a temporary path.  Do all the necessary conversions here, since we
-  // don't want to allocate memory post-fork().
+  // Create the temporary file here, so that the child only has to be given
+  // it as stdout/stderr.
   const auto tempFile = fs::temp_directory_path() / fs::unique_path();
   const std::string tempFileStr = tempFile.native();
-  const char* tempFilePtr = tempFileStr.c_str();
 
-  VLOG(1) << "temporary file: " << tempFileStr;
+  VLOG(1) << "temporary file: " << tempFileStr;
+
+  int fd = open(tempFileStr.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return Status(1, "couldn't create temp file");
+  }
+
+  pid_t p;
+  int err = spawnCommand(arguments, fd, p);
+  close(fd);
+
+  if (err != 0) {
+    fs::remove(tempFile);
+    LOG(ERROR) << "posix_spawn failed: " << err;
+    return Status(1, "posix_spawn failed");
+  }
+
+  // Wait for the subprocess to exit.
+  int status;
+  if (!waitForChild(p, deadline, status)) {
+    terminateChild(p);
+    fs::remove(tempFile);
+    LOG(WARNING) << "terminated " << command[0] << ": subprocess timed out";
+    return Status(1, "subprocess timed out");
+  }
+
+  if (status == -1) {
+    fs::remove(tempFile);
+    return Status(1, "waitpid failed");
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fs::remove(tempFile);
+    return Status(1, "subprocess errored");
+  }
+
+  // Read the output of the subprocess if there's no error.
+  std::ifstream ifs (tempFileStr, std::ios::in | std::ios::binary);
+  boost::system::error_code ec;
+  const auto sz = fs::file_size(tempFile, ec);
+  if (!ifs || ec) {
+    fs::remove(tempFile, ec);
+    return Status(1, "couldn't read temp file");
+  }
+
+  output.resize(sz);
+  ifs.read(&output[0], sz);
+  output.resize(ifs.gcount());
+
+  // All done!
+  ifs.close();
+  fs::remove(tempFile);
+  return Status(0, "OK");
+}
+
+
+/*
+ * This is a helper function to run a subprocess and capture the output through
+ * a pipe.  The output is read in large chunks straight into `output`, so a
+ * caller that reuses the same string (see commandOutputBuffer()) won't
+ * reallocate on every run.
+ *
+ * If the subprocess hasn't finished by the deadline, it is terminated.
+ */
+Status runCommandPipe(const std::vector<std::string>& command, std::string& output, Deadline deadline) {
+  static const size_t kReadChunk = 64 * 1024;
+
+  auto arguments = commandArguments(command);
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return Status(1, "pipe failed");
+  }
+
+  // The read end is ours only.
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+  // Send stdout/stderr to the write end of the pipe.
+  pid_t p;
+  int err = spawnCommand(arguments, fds[1], p);
+  close(fds[1]);
+
+  if (err != 0) {
+    close(fds[0]);
+    LOG(ERROR) << "posix_spawn failed: " << err;
+    return Status(1, "posix_spawn failed");
+  }
+
+  // Read until EOF, or until we give up on the subprocess.  We wake up at
+  // least every kPollSlice to notice cancellation.
+  static const long long kPollSlice = 250;
+
+  size_t length = 0;
+  std::string failure;
+  output.clear();
+
+  while (true) {
+    if (commandsCancelled) {
+      failure = "subprocess cancelled";
+      break;
+    }
+
+    long long wait = kPollSlice;
+    if (deadline != Deadline::max()) {
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now()).count();
+      if (remaining <= 0) {
+        failure = "subprocess timed out";
+        break;
+      }
+      wait = std::min<long long>(wait, remaining);
+    }
+
+    struct pollfd pfd = {fds[0], POLLIN, 0};
+    int n = poll(&pfd, 1, static_cast<int>(wait));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0) {
+      continue;
+    }
+    if (n < 0) {
+      failure = "poll failed";
+      break;
+    }
+
+    // Grow geometrically so large outputs don't keep reallocating.
+    if (output.size() - length < kReadChunk) {
+      output.resize(std::max(output.size() * 2, length + kReadChunk));
+    }
+
+    ssize_t r = read(fds[0], &output[length], output.size() - length);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      failure = "read failed";
+      break;
+    }
+    if (r == 0) {
+      break;
+    }
+
+    length += static_cast<size_t>(r);
+  }
+
+  output.resize(length);
+  close(fds[0]);
+
+  if (!failure.empty()) {
+    terminateChild(p);
+    LOG(WARNING) << "terminated " << command[0] << ": " << failure;
+    return Status(1, failure);
+  }
+
+  // Wait for the subprocess to exit.  It has closed its output, so this should
+  // be quick, but it's still bounded by the deadline.
+  int status;
+  if (!waitForChild(p, deadline, status)) {
+    terminateChild(p);
+    LOG(WARNING) << "terminated " << command[0] << ": subprocess timed out";
+    return Status(1, "subprocess timed out");
+  }
+  if (status == -1) {
+    return Status(1, "waitpid failed");
+  }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return Status(1, "subprocess errored");
+  }
+
+  return Status(0, "OK");
+}
+
+
+/*
+ * This is a helper function to run a subprocess and capture the output, using
+ * the method given by --profiles_capture_mode.  The subprocess is terminated
+ * if it's still running at the deadline (by default, as per
+ * --profiles_command_timeout), or if commands are cancelled.
+ */
+Status runCommand(const std::vector<std::string>& command, std::string& output, Deadline deadline) {
+  if (commandsCancelled) {
+    return Status(1, "subprocess cancelled");
+  }
+
+  ExtensionStats::add(ExtensionStats::COMMANDS_RUN);
+  ScopedTimer timer(ExtensionStats::COMMAND_US);
+
+  Status status;
+  if (FLAGS_profiles_capture_mode == "tempfile") {
+    status = runCommandTempFile(command, output, deadline);
+  } else {
+    status = runCommandPipe(command, output, deadline);
+  }
+
+  if (status.ok()) {
+    ExtensionStats::add(ExtensionStats::BYTES_CAPTURED, output.size());
+  } else if (status.getMessage() == "subprocess timed out") {
+    ExtensionStats::add(ExtensionStats::COMMAND_TIMEOUTS);
+  } else {
+    ExtensionStats::add(ExtensionStats::COMMAND_FAILURES);
+  }
+  return status;
+}
+
+Status runCommand(const std::vector<std::string>& command, std::string& output) {
+  return runCommand(command, output, commandDeadline());
+}
+
+
+/*
+ * This class caches rows from the `users` table, keyed by username, for
+ * --profiles_users_cache_ttl seconds.  Every lookup against the table is a
+ * round trip to osqueryd, and joins would otherwise repeat the same lookups
+ * for every outer row.
+ */
+class UserCache {
+ public:
+  static UserCache& instance() {
+    static UserCache cache;
+    return cache;
+  }
+
+  // Returns the rows for those of the given users that exist, in username
+  // order.  Anything that isn't cached is looked up with a single query.
+  QueryData lookup(const std::set<std::string>& usernames) {
+    std::vector<std::string> missing;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& username : usernames) {
+        auto it = entries_.find(username);
+        if (it == entries_.end() || !isFresh(it->second)) {
+          missing.push_back(username);
+        }
+      }
+    }
+
+    if (!missing.empty()) {
+      QueryData found;
+      if (!selectUsers(missing, found)) {
+        // Fall back to looking everything up one by one.
+        for (const auto& username : missing) {
+          auto user = SQL::selectAllFrom("users", "username", EQUALS, username);
+          found.insert(found.end(), user.begin(), user.end());
+        }
+      }
+
+      const auto now = std::chrono::steady_clock::now();
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      // Anything we asked for but didn't get back doesn't exist.
+      for (const auto& username : missing) {
+        entries_[username] = Entry{false, Row(), now};
+      }
+      for (auto& row : found) {
+        auto it = row.find("username");
+        if (it != row.end()) {
+          auto username = it->second;
+          entries_[username] = Entry{true, std::move(row), now};
+        }
+      }
+    }
+
+    QueryData users;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& username : usernames) {
+      auto it = entries_.find(username);
+      if (it != entries_.end() && it->second.exists) {
+        users.push_back(it->second.row);
+      }
+    }
+    return users;
+  }
+
+ private:
+  struct Entry {
+    bool exists;
+    Row row;
+    std::chrono::steady_clock::time_point fetched;
+  };
+
+  UserCache() = default;
+
+  bool isFresh(const Entry& entry) const {
+    const auto age = std::chrono::steady_clock::now() - entry.fetched;
+    return age < std::chrono::seconds(FLAGS_profiles_users_cache_ttl);
+  }
+
+  // Looks up all of the given users with one `IN (...)` query.
+  static bool selectUsers(const std::vector<std::string>& usernames, QueryData& users) {
+    std::string query = "SELECT * FROM users WHERE username IN (";
+    for (size_t i = 0; i < usernames.size(); i++) {
+      if (i > 0) {
+        query += ", ";
+      }
+      query += "'" + boost::algorithm::replace_all_copy(usernames[i], "'", "''") + "'";
+    }
+    query += ")";
+
+    SQL sql(query);
+    if (!sql.ok()) {
+      VLOG(1) << "batched users lookup failed: " << sql.getMessageString();
+      return false;
+    }
+
+    users = sql.rows();
+    return true;
+  }
+
+  std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+};
+
+
+/*
+ * Helper function, mostly copied from osquery's source code.
+ *
+ * This function extracts a list of usernames given in the input query.
+ */
+QueryData usersFromContext(const QueryContext& context, bool all = false) {
+  QueryData users;
+
+  // If the user gave a 'username' constraint, get the user with that username
+  // (this will helpfully also not do anything if the user does not exist).
+  if (context.hasConstraint("username", EQUALS)) {
+    std::set<std::string> usernames;
+    context.forEachConstraint(
+        "username",
+        EQUALS,
+        ([&usernames](const std::string& expr) {
+          usernames.insert(expr);
+        }));
+    users = UserCache::instance().lookup(usernames);
+  } else if (!all) {
+    // The user did not give a username, and did not want everything - return
+    // ourselves.
+    users =
+        SQL::selectAllFrom("users", "uid", EQUALS, std::to_string(getuid()));
+  } else {
+    // Return all users.
+    users = SQL::selectAllFrom("users");
+  }
+  return users;
+}
+
+
+/*
+ * The root key of the `profiles` plist is either the username, or the literal
+ * string "_computerlevel" for system-wide profiles.  We use the same string to
+ * identify a scope everywhere else (e.g. in the cache).
+ */
+std::string scopeForUser(const std::string& username) {
+  if (username.length() > 0) {
+    return username;
+  }
+  return "_computerlevel";
+}
+
+
+std::string hashString(uint64_t hash) {
+  static const char kHexDigits[] = "0123456789abcdef";
+
+  std::string result(16, '0');
+  for (size_t i = 16; i-- > 0; hash >>= 4) {
+    result[i] = kHexDigits[hash & 0xF];
+  }
+  return result;
+}
+
+
+/*
+ * How much of each profile a query needs.  Anything not needed isn't even
+ * parsed, and a cached profile can answer any query that needs the same
+ * amount of detail or less.
+ */
+enum class ProfileDetail {
+  // Only the profile's own keys, without its ProfileItems.
+  PROFILE = 0,
+
+  // The profile and its ProfileItems, but without each item's PayloadContent.
+  ITEMS = 1,
+
+  // Everything.
+  CONTENT = 2,
+};
+
+
+/*
+ * This class caches the parsed output of the `profiles` command, keyed by
+ * scope.  Entries are considered stale once they are older than both the
+ * --profiles_cache_ttl and --profiles_query_window_ms flags, and can be
+ * dropped early with invalidateAll().
+ *
+ * While the profile store is being watched for changes (see
+ * ProfileStoreWatcher), entries are dropped when the watcher invalidates them,
+ * and otherwise only expire after --profiles_refresh_max_interval (if that is
+ * longer than the TTL), so that a missed change can't be hidden for long.
+ *
+ * The cached entries are held in an immutable, versioned snapshot that is
+ * shared by both tables.  Every change swaps in a new snapshot atomically, so
+ * readers never take a lock and always see a consistent set of scopes.
+ */
+class ProfileCache {
+ public:
+  struct Entry {
+    // The result of parsing the command output; this is returned to callers
+    // as-is so that cached and uncached lookups behave the same.
+    Status status;
+    ProfileColumns columns;
+    std::chrono::steady_clock::time_point fetched;
+
+    // How much of each profile was parsed.
+    ProfileDetail detail = ProfileDetail::CONTENT;
+
+  };
+
+  using EntryRef = std::shared_ptr<const Entry>;
+
+  struct Snapshot {
+    // Incremented every time the cache changes.
+    uint64_t version = 0;
+
+    std::map<std::string, EntryRef> entries;
+
+    // If every scope was collected at once, this is the answer for a scope
+    // that wasn't seen (i.e. one with no profiles).
+    EntryRef absent;
+  };
+
+  using SnapshotRef = std::shared_ptr<const Snapshot>;
+
+  static ProfileCache& instance() {
+    static ProfileCache cache;
+    return cache;
+  }
+
+  SnapshotRef snapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+
+  // Returns the entry for the given scope, or nullptr if there is no entry, it
+  // has expired, or it doesn't have the detail that the caller needs.
+  EntryRef get(const std::string& scope, ProfileDetail detail) const {
+    auto entry = find(scope, detail);
+    ExtensionStats::add((entry != nullptr) ? ExtensionStats::CACHE_HITS : ExtensionStats::CACHE_MISSES);
+    return entry;
+  }
+
+  // Returns the detail that a collection should be done at, given that the
+  // caller needs `detail`.  Once a query has needed more detail, we keep
+  // collecting it for as long as entries stay fresh, so that e.g. joins
+  // between both tables can be answered from a single collection.  When no
+  // query has needed it for that long, collections drop back to what their
+  // callers need.
+  ProfileDetail collectionDetail(ProfileDetail detail) {
+    const auto now = std::chrono::steady_clock::now();
+    const auto wanted = static_cast<int>(detail);
+    if (detail != ProfileDetail::PROFILE) {
+      neededAt_[wanted] = now.time_since_epoch().count();
+    }
+
+    const auto window = std::max<std::chrono::steady_clock::duration>(
+        std::chrono::seconds(FLAGS_profiles_cache_ttl),
+        std::chrono::milliseconds(FLAGS_profiles_query_window_ms));
+    for (auto level = static_cast<int>(ProfileDetail::CONTENT); level > wanted; level--) {
+      const auto neededAt = neededAt_[level].load();
+      if (neededAt != kNeverNeeded && now.time_since_epoch().count() - neededAt <= window.count()) {
+        return static_cast<ProfileDetail>(level);
+      }
+    }
+    return detail;
+  }
+
+  // Stores the entry for the given scope.  `collectedSince` is the value of
+  // invalidations() from before the entry was collected: if anything has been
+  // invalidated since, the entry may predate the change and isn't stored.
+  void put(const std::string& scope, EntryRef entry, uint64_t collectedSince) {
+    if (!enabled()) {
+      return;
+    }
+
+    update([&](Snapshot& next) {
+      if (invalidations_ != collectedSince) {
+        return false;
+      }
+      next.entries[scope] = std::move(entry);
+      return true;
+    });
+  }
+
+  void put(const std::string& scope, EntryRef entry) {
+    put(scope, std::move(entry), invalidations_);
+  }
+
+  // Replaces the cache contents with the result of collecting every scope at
+  // once.  Any scope not in `entries` is answered with `absent` from now on.
+  void putAll(const std::map<std::string, EntryRef>& entries, EntryRef absent, uint64_t collectedSince) {
+    if (!enabled()) {
+      return;
+    }
+
+    update([&](Snapshot& next) {
+      if (invalidations_ != collectedSince) {
+        return false;
+      }
+      next.entries = entries;
+      next.absent = std::move(absent);
+      return true;
+    });
+  }
+
+  void invalidateAll() {
+    update([this](Snapshot& next) {
+      next.entries.clear();
+      next.absent = nullptr;
+      invalidated();
+      return true;
+    });
+  }
+
+  // Counts invalidations, so that collections and the refresher can tell when
+  // something has changed behind their back.
+  uint64_t invalidations() const {
+    return invalidations_;
+  }
+
+  // Returns the entry for the given scope whether or not it has expired, or
+  // nullptr if there is none with the detail that the caller needs.  This is
+  // for when collecting a fresh one has failed.
+  EntryRef getStale(const std::string& scope, ProfileDetail detail) const {
+    auto current = snapshot();
+
+    auto it = current->entries.find(scope);
+    if (it != current->entries.end()) {
+      return (it->second->detail >= detail) ? it->second : nullptr;
+    }
+    return current->absent;
+  }
+
+  // Serves the given snapshot (e.g. one saved by a previous run) until
+  // clearRestored() is called, for any scope that isn't otherwise cached.  Its
+  // entries never expire, since the point is to answer queries while a fresh
+  // collection is running.
+  void restore(SnapshotRef restored) {
+    std::atomic_store(&restored_, std::move(restored));
+  }
+
+  void clearRestored() {
+    std::atomic_store(&restored_, SnapshotRef());
+  }
+
+  SnapshotRef restored() const {
+    return std::atomic_load(&restored_);
+  }
+
+  // Records that the given user's profiles have been asked for, so that the
+  // refresher keeps them up to date too.
+  void addUsers(const std::vector<std::string>& usernames) {
+    std::lock_guard<std::mutex> lock(usersMutex_);
+    users_.insert(usernames.begin(), usernames.end());
+  }
+
+  std::vector<std::string> users() const {
+    std::lock_guard<std::mutex> lock(usersMutex_);
+    return std::vector<std::string>(users_.begin(), users_.end());
+  }
+
+  // Whether the watcher is receiving change events for the profile store.
+  bool watched() const {
+    return watched_;
+  }
+
+  // Called by the watcher when it starts or stops receiving change events.
+  // Either way, anything cached so far can't be trusted any more.
+  void setWatched(bool watched) {
+    watched_ = watched;
+    invalidateAll();
+  }
+
+ private:
+  ProfileCache() : snapshot_(std::make_shared<Snapshot>()) {}
+
+  EntryRef find(const std::string& scope, ProfileDetail detail) const {
+    auto current = snapshot();
+
+    auto it = current->entries.find(scope);
+    if (it != current->entries.end() && isFresh(*it->second)) {
+      return (it->second->detail >= detail) ? it->second : nullptr;
+    }
+
+    if (current->absent != nullptr && isFresh(*current->absent)) {
+      return current->absent;
+    }
+
+    auto restored = std::atomic_load(&restored_);
+    if (restored != nullptr) {
+      auto it = restored->entries.find(scope);
+      if (it != restored->entries.end()) {
+        return (it->second->detail >= detail) ? it->second : nullptr;
+      }
+      return restored->absent;
+    }
+
+    return nullptr;
+  }
+
+  // Even with caching disabled, entries are kept for the query window, so
+  // that e.g. a join that calls profile_items once per outer row (or an IN
+  // list, which osqueryd may answer one value at a time) is answered from a
+  // single collection.
+  bool enabled() const {
+    return FLAGS_profiles_cache_ttl > 0 || FLAGS_profiles_query_window_ms > 0;
+  }
+
+  bool isFresh(const Entry& entry) const {
+    const auto age = std::chrono::steady_clock::now() - entry.fetched;
+    // A watched entry is still refetched now and then, in case the watcher
+    // missed a change.
+    const auto watchedTtl = std::max(FLAGS_profiles_cache_ttl, FLAGS_profiles_refresh_max_interval);
+    return (watched_ && age < std::chrono::seconds(watchedTtl)) ||
+           age < std::chrono::seconds(FLAGS_profiles_cache_ttl) ||
+           age < std::chrono::milliseconds(FLAGS_profiles_query_window_ms);
+  }
+
+  // Copies the current snapshot, applies the given change to it, and swaps it
+  // in (unless the change returns false).  Writers are serialized so that no
+  // change is lost.
+  template<typename Fn>
+  void update(Fn change) {
+    std::lock_guard<std::mutex> lock(writeMutex_);
+
+    auto next = std::make_shared<Snapshot>(*snapshot());
+    if (!change(*next)) {
+      return;
+    }
+    next->version++;
+
+    std::atomic_store(&snapshot_, SnapshotRef(std::move(next)));
+  }
+
+  // Called with `writeMutex_` held, so that put() can't miss an invalidation.
+  void invalidated() {
+    invalidations_++;
+  }
+
+  std::atomic<bool> watched_{false};
+  std::atomic<uint64_t> invalidations_{0};
+  SnapshotRef restored_;
+
+  // When each detail was last needed by a query, as a steady_clock tick count.
+  static constexpr std::chrono::steady_clock::rep kNeverNeeded =
+      std::numeric_limits<std::chrono::steady_clock::rep>::min();
+  std::atomic<std::chrono::steady_clock::rep> neededAt_[3]{{kNeverNeeded}, {kNeverNeeded}, {kNeverNeeded}};
+
+  std::mutex writeMutex_;
+  SnapshotRef snapshot_;
+
+  // Every user whose profiles have been asked for, plus "" for the
+  // system-wide profiles.
+  mutable std::mutex usersMutex_;
+  std::set<std::string> users_{""};
+};
+
+
+/*
+ * This service watches the directories that make up the configuration profile
+ * store, and the store files themselves, and invalidates the profile cache
+ * whenever anything in them changes (e.g. when a profile is installed or
+ * removed).  The files have to be watched too: a directory only reports
+ * entries being added, removed or renamed, not a file in it being rewritten.
+ */
+class ProfileStoreWatcher : public InternalRunnable {
+ public:
+  void start() override {
+    while (!interrupted()) {
+      int kq = kqueue();
+      if (kq < 0) {
+        LOG(ERROR) << "kqueue failed, profile store will not be watched";
+        return;
+      }
+
+      // (Re-)open all the directories and files we want to watch.  We do this
+      // every time something changes, since they may have been created,
+      // removed or replaced.
+      std::vector<int> fds;
+      for (const auto& path : watchPaths()) {
+        int fd = open(path.c_str(), O_EVTONLY);
+        if (fd < 0) {
+          continue;
+        }
+
+        struct kevent change;
+        EV_SET(&change, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME | NOTE_ATTRIB,
+               0, nullptr);
+        if (kevent(kq, &change, 1, nullptr, 0, nullptr) < 0) {
+          close(fd);
+          continue;
+        }
+
+        fds.push_back(fd);
+      }
+
+      if (fds.empty()) {
+        VLOG(1) << "no profile store directories or files found, not watching";
+        close(kq);
+        break;
+      }
+
+      ProfileCache::instance().setWatched(true);
+      waitForChange(kq);
+
+      for (const auto fd : fds) {
+        close(fd);
+      }
+      close(kq);
+    }
+
+    ProfileCache::instance().setWatched(false);
+  }
+
+ private:
+  std::vector<std::string> watchPaths() const {
+    std::vector<std::string> paths = {
+      "/var/db/ConfigurationProfiles",
+      kStore,
+      "/var/db/ConfigurationProfiles/Settings",
+      kManagedPreferences,
+    };
+
+    // User-level profiles are applied to per-user subdirectories of the
+    // managed preferences directory.
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(kManagedPreferences, ec), end; !ec && it != end; it.increment(ec)) {
+      if (fs::is_directory(it->status())) {
+        paths.push_back(it->path().string());
+      }
+    }
+
+    // The store files, which may be rewritten in place.
+    paths.push_back(FLAGS_profiles_store_path);
+    for (fs::directory_iterator it(kStore, ec), end; !ec && it != end; it.increment(ec)) {
+      if (fs::is_regular_file(it->status()) && it->path().string() != FLAGS_profiles_store_path) {
+        paths.push_back(it->path().string());
+      }
+    }
+
+    return paths;
+  }
+
+  // Blocks until something in the store changes (or we're asked to stop), and
+  // then invalidates the cache.
+  void waitForChange(int kq) {
+    struct kevent event;
+    struct timespec timeout = {1, 0};
+
+    while (!interrupted()) {
+      int n = kevent(kq, nullptr, 0, &event, 1, &timeout);
+      if (n < 0 && errno != EINTR) {
+        return;
+      }
+      if (n <= 0) {
+        continue;
+      }
+
+      // Drop the cache straight away so nobody is served stale data, and then
+      // again once the changes have settled, since installing a profile
+      // touches several files and a query may have raced with it.
+      VLOG(1) << "profile store changed, invalidating cache";
+      ProfileCache::instance().invalidateAll();
+
+      struct timespec settle = {0, 250 * 1000 * 1000};
+      while (kevent(kq, nullptr, 0, &event, 1, &settle) > 0) {
+      }
+
+      ProfileCache::instance().invalidateAll();
+      return;
+    }
+  }
+
+  const std::string kManagedPreferences = "/Library/Managed Preferences";
+  const std::string kStore = "/var/db/ConfigurationProfiles/Store";
+};
+
+
+/*
+ * This helper function will parse the output of a `profiles` command that
+ * covers several scopes, and call the given callback with each scope's root
+ * key and each profile under it.  Anything beyond the given detail (e.g. the
+ * large ProfileItems of each profile) is skipped.
+ */
+template<typename Fn>
+Status parseAllProfiles(const std::string& commandOutput, ProfileDetail detail, Fn callback) {
+  static const std::set<std::string> kSkipItems = {"ProfileItems"};
+  static const std::set<std::string> kSkipContent = {"ProfileItems.PayloadContent"};
+  static const std::set<std::string> kSkipNothing;
+
+  ExtensionStats::add(ExtensionStats::PARSES);
+  ScopedTimer timer(ExtensionStats::PARSE_US);
+
+  switch (detail) {
+  case ProfileDetail::PROFILE:
+    return streamProfiles(commandOutput, kSkipItems, callback);
+  case ProfileDetail::ITEMS:
+    return streamProfiles(commandOutput, kSkipContent, callback);
+  default:
+    return streamProfiles(commandOutput, kSkipNothing, callback);
+  }
+}
+
+
+/*
+ * This helper function will parse the output of the `profiles` command and
+ * call the given callback with each parsed result.
+ */
+template<typename Fn>
+Status parseProfile(const std::string& commandOutput, const std::string& username, ProfileDetail detail, Fn callback) {
+  // Handle the case where the user does not exist.
+  if (boost::starts_with(commandOutput, "profiles: the user could not be found")) {
+    return Status(1, "User not found");
+  }
+
+  const auto rootKey = scopeForUser(username);
+  bool found = false;
+
+  auto status = parseAllProfiles(commandOutput, detail, [&](const std::string& scope, PlistTree& profile) {
+    if (scope != rootKey) {
+      return;
+    }
+
+    found = true;
+    callback(username, profile);
+  });
+
+  // Output that isn't a plist is treated as an empty (but successful) result.
+  if (status.ok() && !found) {
+    return Status(1, "No profiles");
+  }
+
+  return Status(0, "OK");
+}
+
+
+/*
+ * This helper function returns true if we should collect every scope at once,
+ * as per --profiles_collection_mode.
+ */
+bool useBulkCollection() {
+  if (FLAGS_profiles_collection_mode == "bulk" ||
+      FLAGS_profiles_collection_mode == "native") {
+    return true;
+  } else if (FLAGS_profiles_collection_mode == "scope") {
+    return false;
+  }
+
+  // Listing the profiles for all users requires root.
+  return geteuid() == 0;
+}
+
+
+/*
+ * This helper function returns true if we should read the profile store
+ * directly (rather than running `profiles`) when collecting every scope.  This
+ * is opt-in only: 'auto' never picks it, so that the profiles, hashes and
+ * change reports of a host don't depend on which collection happened to work.
+ */
+bool useNativeCollection() {
+  return FLAGS_profiles_collection_mode == "native";
+}
+
+
+/*
+ * This helper function returns the `profiles` command that lists the profiles
+ * for the given user, or the system-wide profiles if no user is given.
+ */
+std::vector<std::string> profilesCommand(const std::string& username) {
+  if (username.length() > 0) {
+    return {"/usr/bin/profiles", "-L", "-o", "stdout-xml", "-U", username};
+  }
+  return {"/usr/bin/profiles", "-C", "-o", "stdout-xml"};
+}
+
+
+/*
+ * This class coalesces concurrent collections of the same thing: while a
+ * collection for a key is running, anyone else who asks for the same key waits
+ * for it and gets the same result (or exception), rather than starting another
+ * one.
+ */
+template<typename T>
+class SingleFlight {
+ public:
+  template<typename Fn>
+  T run(const std::string& key, Fn collect) {
+    std::promise<T> promise;
+    std::shared_future<T> result;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = inFlight_.find(key);
+      if (it != inFlight_.end()) {
+        result = it->second;
+      } else {
+        inFlight_[key] = promise.get_future().share();
+      }
+    }
+
+    if (result.valid()) {
+      VLOG(1) << "waiting for in-flight collection: " << key;
+      ExtensionStats::add(ExtensionStats::COALESCED_COLLECTIONS);
+      return result.get();
+    }
+
+    try {
+      promise.set_value(collect());
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    result = inFlight_[key];
+    inFlight_.erase(key);
+    return result.get();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::map<std::string, std::shared_future<T>> inFlight_;
+};
+
+
+/*
+ * This class limits how many scopes are collected at once across the whole
+ * extension to --profiles_collection_threads, however many queries are being
+ * answered concurrently.  A collection holds a Slot for as long as it runs.
+ */
+class CollectionLimit {
+ public:
+  class Slot {
+   public:
+    explicit Slot(CollectionLimit& limit) : limit_(limit) {
+      limit_.acquire();
+    }
+
+    ~Slot() {
+      limit_.release();
+    }
+
+   private:
+    CollectionLimit& limit_;
+  };
+
+  static CollectionLimit& instance() {
+    static CollectionLimit limit;
+    return limit;
+  }
+
+ private:
+  void acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this]() {
+      return running_ < std::max<uint64_t>(FLAGS_profiles_collection_threads, 1);
+    });
+    running_++;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_--;
+    }
+    changed_.notify_one();
+  }
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  uint64_t running_ = 0;
+};
+
+
+/*
+ * This helper function returns the calling thread's buffer for capturing
+ * command output into.  On long-lived threads - osquery's Thrift workers and
+ * the background services - this saves reallocating it on every run; the
+ * threads that loadScopesParallel() starts for one query begin with an empty
+ * one.  A buffer that has grown past kMaxKeptOutput (for an unusually large
+ * output) is released rather than kept around.
+ */
+std::string& commandOutputBuffer() {
+  static const size_t kMaxKeptOutput = 4 * 1024 * 1024;
+
+  thread_local std::string buffer;
+  if (buffer.capacity() > kMaxKeptOutput) {
+    std::string().swap(buffer);
+  }
+  return buffer;
+}
+
+
+/*
+ * This helper function runs the `profiles` command for a single scope, and
+ * stores the result in the cache.  It returns nullptr if the command could not
+ * be run.
+ */
+ProfileCache::EntryRef collectScopeOnce(const std::string& username, ProfileDetail detail) {
+  auto& cache = ProfileCache::instance();
+  CollectionLimit::Slot slot(CollectionLimit::instance());
+
+  // NOTE: If the command fails we don't cache anything, so that the next
+  // query will try again.
+  const auto invalidations = cache.invalidations();
+  auto& commandOutput = commandOutputBuffer();
+  if (!runCommand(profilesCommand(username), commandOutput).ok()) {
+    return nullptr;
+  }
+
+  auto fresh = std::make_shared<ProfileCache::Entry>();
+  ProfileColumnsBuilder builder;
+  fresh->status = parseProfile(commandOutput, username, detail, [&builder](const std::string&, PlistTree& profile) {
+    builder.add(profile);
+  });
+  fresh->columns = builder.finish();
+  fresh->fetched = std::chrono::steady_clock::now();
+  fresh->detail = detail;
+
+  cache.put(scopeForUser(username), fresh, invalidations);
+  return fresh;
+}
+
+
+/*
+ * This helper function is collectScopeOnce(), except that concurrent callers
+ * for the same scope share a single run of the `profiles` command.  A caller
+ * that needs more detail than the shared run collected starts another one.
+ */
+ProfileCache::EntryRef collectScope(const std::string& username, ProfileDetail detail) {
+  static SingleFlight<ProfileCache::EntryRef> flights;
+
+  detail = ProfileCache::instance().collectionDetail(detail);
+  while (true) {
+    auto entry = flights.run(scopeForUser(username), [&]() {
+      return collectScopeOnce(username, detail);
+    });
+    if (entry == nullptr || entry->detail >= detail) {
+      return entry;
+    }
+  }
+}
+
+
+/*
+ * This helper function returns the profiles for a single scope, either from
+ * the cache or by running the `profiles` command.  If the command could not be
+ * run, it returns the expired cache entry (if --profiles_serve_stale is set
+ * and there is one), or nullptr.
+ */
+ProfileCache::EntryRef loadScope(const std::string& username, ProfileDetail detail) {
+  auto entry = ProfileCache::instance().get(scopeForUser(username), detail);
+  if (entry != nullptr) {
+    VLOG(1) << "using cached profiles for scope: " << scopeForUser(username);
+    return entry;
+  }
+
+  entry = collectScope(username, detail);
+  if (entry == nullptr && FLAGS_profiles_serve_stale) {
+    entry = ProfileCache::instance().getStale(scopeForUser(username), detail);
+    if (entry != nullptr) {
+      LOG(WARNING) << "collecting profiles failed, using stale profiles for scope: " << scopeForUser(username);
+      ExtensionStats::add(ExtensionStats::STALE_HITS);
+    }
+  }
+  return entry;
+}
+
+
+/*
+ * This helper function collects the profiles for every scope, either from the
+ * profile store (falling back to the `profiles` command if the store can't be
+ * read) or by running the `profiles` command once, and calls the given
+ * callback with each of them.
+ */
+Status collectAllScopes(ProfileDetail detail, const ProfileCallback& callback) {
+  if (useNativeCollection()) {
+    PlistTree tree;
+    Status status;
+    {
+      ExtensionStats::add(ExtensionStats::STORE_READS);
+      ScopedTimer timer(ExtensionStats::STORE_READ_US);
+      status = readProfileStore(FLAGS_profiles_store_path, tree);
+    }
+    if (status.ok()) {
+      for (auto& scope : tree) {
+        for (auto& it : scope.second) {
+          callback(scope.first, it.second);
+        }
+      }
+      return status;
+    }
+
+    // The store's format isn't documented, so if it can't be read (e.g. after
+    // an OS update changed it), `profiles` still works.
+    VLOG(1) << "falling back to /usr/bin/profiles: " << status.getMessage();
+  }
+
+  auto& commandOutput = commandOutputBuffer();
+  auto status = runCommand({"/usr/bin/profiles", "-P", "-o", "stdout-xml"}, commandOutput);
+  if (!status.ok()) {
+    return status;
+  }
+
+  return parseAllProfiles(commandOutput, detail, callback);
+}
+
+
+/*
+ * The result of collecting the profiles for every scope at once.  The `absent`
+ * entry is what should be returned for scopes that weren't collected.
+ */
+struct AllScopes {
+  Status status;
+  ProfileDetail detail;
+  std::map<std::string, ProfileCache::EntryRef> entries;
+  ProfileCache::EntryRef absent;
+};
+
+
+/*
+ * This helper function collects the profiles for every scope at once, and
+ * stores them in the cache.
+ */
+std::shared_ptr<const AllScopes> collectAllScopesOnce(ProfileDetail detail) {
+  auto result = std::make_shared<AllScopes>();
+  result->detail = detail;
+
+  // NOTE: As in collectScopeOnce(), nothing is cached if the profile store
+  // changed while collecting.
+  const auto invalidations = ProfileCache::instance().invalidations();
+  std::map<std::string, ProfileColumnsBuilder> collected;
+  result->status = collectAllScopes(detail, [&collected](const std::string& scope, PlistTree& profile) {
+    collected[scope].add(profile);
+  });
+  if (!result->status.ok()) {
+    return result;
+  }
+
+  const auto fetched = std::chrono::steady_clock::now();
+  for (auto& it : collected) {
+    auto entry = std::make_shared<ProfileCache::Entry>();
+    entry->columns = it.second.finish();
+    entry->fetched = fetched;
+    entry->detail = detail;
+    result->entries[it.first] = entry;
+  }
+
+  auto none = std::make_shared<ProfileCache::Entry>();
+  none->status = Status(1, "No profiles");
+  none->fetched = fetched;
+  result->absent = none;
+
+  ProfileCache::instance().putAll(result->entries, result->absent, invalidations);
+  return result;
+}
+
+
+/*
+ * This helper function is collectAllScopesOnce(), except that concurrent
+ * callers share a single collection (as long as it has enough detail).
+ */
+Status loadAllScopes(ProfileDetail detail,
+                     std::map<std::string, ProfileCache::EntryRef>& entries,
+                     ProfileCache::EntryRef& absent) {
+  static SingleFlight<std::shared_ptr<const AllScopes>> flights;
+
+  std::shared_ptr<const AllScopes> result;
+  do {
+    result = flights.run("", [detail]() { return collectAllScopesOnce(detail); });
+  } while (result->status.ok() && result->detail < detail);
+
+  entries = result->entries;
+  absent = result->absent;
+  return result->status;
+}
+
+
+/*
+ * This helper function loads the profiles for all of the given users in one
+ * go, unless they're all cached already.
+ */
+std::vector<ProfileCache::EntryRef> loadScopesBulk(const std::vector<std::string>& usernames, ProfileDetail detail) {
+  std::vector<ProfileCache::EntryRef> entries(usernames.size());
+
+  bool missing = false;
+  for (size_t i = 0; i < usernames.size(); i++) {
+    entries[i] = ProfileCache::instance().get(scopeForUser(usernames[i]), detail);
+    missing = missing || entries[i] == nullptr;
+  }
+  if (!missing) {
+    return entries;
+  }
+
+  // NOTE: As with a single scope, we skip everything if the command fails.
+  std::map<std::string, ProfileCache::EntryRef> all;
+  ProfileCache::EntryRef absent;
+  auto status = loadAllScopes(ProfileCache::instance().collectionDetail(detail), all, absent);
+  if (!status.ok()) {
+    VLOG(1) << "collecting all profiles failed: " << status.getMessage();
+
+    for (size_t i = 0; i < usernames.size(); i++) {
+      if (entries[i] == nullptr && FLAGS_profiles_serve_stale) {
+        entries[i] = ProfileCache::instance().getStale(scopeForUser(usernames[i]), detail);
+        if (entries[i] != nullptr) {
+          ExtensionStats::add(ExtensionStats::STALE_HITS);
+        }
+      }
+    }
+    return entries;
+  }
+
+  for (size_t i = 0; i < usernames.size(); i++) {
+    auto it = all.find(scopeForUser(usernames[i]));
+    entries[i] = (it != all.end()) ? it->second : absent;
+  }
+
+  return entries;
+}
+
+
+/*
+ * This helper function saves the cached profiles to --profiles_snapshot_path,
+ * unless they haven't changed since the last time.  It's only called from
+ * background services, so that no query waits for it.
+ */
+void saveSnapshot() {
+  static std::mutex mutex;
+  static uint64_t savedVersion = 0;
+
+  if (FLAGS_profiles_snapshot_path.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto current = ProfileCache::instance().snapshot();
+  if (current->version == savedVersion) {
+    return;
+  }
+
+  // The entries are written straight from `current`, which keeps them alive.
+  std::vector<StoredScopeRef> scopes;
+  auto store = [&scopes](const std::string& scope, const ProfileCache::Entry& entry) {
+    scopes.emplace_back();
+    scopes.back().scope = scope;
+    scopes.back().statusCode = entry.status.getCode();
+    scopes.back().statusMessage = entry.status.getMessage();
+    scopes.back().detail = static_cast<int>(entry.detail);
+    scopes.back().columns = &entry.columns;
+  };
+  for (const auto& it : current->entries) {
+    store(it.first, *it.second);
+  }
+  if (current->absent != nullptr) {
+    store("", *current->absent);
+  }
+
+  auto status = writeProfileSnapshot(FLAGS_profiles_snapshot_path, scopes);
+  if (!status.ok()) {
+    LOG(WARNING) << "couldn't save profiles snapshot: " << status.getMessage();
+    return;
+  }
+
+  savedVersion = current->version;
+  ExtensionStats::add(ExtensionStats::SNAPSHOT_SAVES);
+}
+
+
+/*
+ * This helper function loads the profiles for all of the given users, using
+ * up to --profiles_collection_threads threads.  The returned entries are in
+ * the same order as the given usernames.
+ *
+ * The threads only bound this call; CollectionLimit is what bounds the number
+ * of `profiles` commands running across all concurrent queries.
+ */
+std::vector<ProfileCache::EntryRef> loadScopesParallel(const std::vector<std::string>& usernames, ProfileDetail detail) {
+  std::vector<ProfileCache::EntryRef> entries(usernames.size());
+
+  auto numThreads = std::min<size_t>(FLAGS_profiles_collection_threads, usernames.size());
+  if (numThreads <= 1) {
+    for (size_t i = 0; i < usernames.size(); i++) {
+      entries[i] = loadScope(usernames[i], detail);
+    }
+    return entries;
+  }
+
+  // Each worker takes the next user that nobody has started on yet, and
+  // stores the result in that user's slot.
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < usernames.size()) {
+      try {
+        entries[i] = loadScope(usernames[i], detail);
+      } catch (const std::exception& e) {
+        LOG(ERROR) << "collecting profiles for " << usernames[i] << " failed: " << e.what();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < numThreads; i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  return entries;
+}
+
+
+/*
+ * This helper function loads the profiles for all of the given users, either
+ * all at once or one user at a time, as per --profiles_collection_mode.  The
+ * returned entries are in the same order as the given usernames.
+ */
+std::vector<ProfileCache::EntryRef> loadScopes(const std::vector<std::string>& usernames, ProfileDetail detail) {
+  ProfileCache::instance().addUsers(usernames);
+
+  return useBulkCollection() ? loadScopesBulk(usernames, detail)
+                             : loadScopesParallel(usernames, detail);
+}
+
+
+/*
+ * This helper function collects the profiles for all of the given users,
+ * whether or not they're cached, and stores them in the cache.  It stops early
+ * (between users) once `stop` returns true.
+ */
+template<typename Fn>
+void loadScopesFresh(const std::vector<std::string>& usernames, ProfileDetail detail, Fn stop) {
+  if (useBulkCollection()) {
+    std::map<std::string, ProfileCache::EntryRef> entries;
+    ProfileCache::EntryRef absent;
+    auto status = loadAllScopes(detail, entries, absent);
+    if (!status.ok()) {
+      VLOG(1) << "collecting all profiles failed: " << status.getMessage();
+    }
+    return;
+  }
+
+  for (const auto& username : usernames) {
+    if (stop()) {
+      return;
+    }
+    collectScope(username, detail);
+  }
+}
+
+void loadScopesFresh(const std::vector<std::string>& usernames, ProfileDetail detail) {
+  loadScopesFresh(usernames, detail, []() { return false; });
+}
+
+
+/*
+ * This helper function returns the username whose profiles are in the given
+ * scope; the inverse of scopeForUser().
+ */
+std::string userForScope(const std::string& scope) {
+  return (scope == "_computerlevel") ? "" : scope;
+}
+
 
-  pid_t p = fork();
-  if (p < 0) {
-    LOG(ERROR) << "fork failed: " << p;
-    return Status(1, "fork failed");
+/*
+ * This helper function loads the snapshot saved by a previous run (if any)
+ * into the cache, to be served until it has been revalidated.  It returns
+ * false if there was nothing to load.
+ */
+bool restoreSnapshot() {
+  std::vector<StoredScope> scopes;
+  uint64_t age = 0;
+  auto status = readProfileSnapshot(FLAGS_profiles_snapshot_path, scopes, age);
+  if (!status.ok()) {
+    VLOG(1) << "not restoring profiles snapshot: " << status.getMessage();
+    return false;
   }
 
-  if (p == 0) {
-    // Open the temporary file.
-    int fd = open(tempFilePtr, O_RDWR | O_CREAT, 0600);
+  auto& cache = ProfileCache::instance();
+  auto restored = std::make_shared<ProfileCache::Snapshot>();
+  const auto fetched = std::chrono::steady_clock::now() - std::chrono::seconds(age);
+
+  std::vector<std::string> usernames;
+  for (auto& scope : scopes) {
+    auto entry = std::make_shared<ProfileCache::Entry>();
+    entry->status = Status(scope.statusCode, scope.statusMessage);
+    entry->columns = std::move(scope.columns);
+    entry->fetched = fetched;
+    entry->detail = static_cast<ProfileDetail>(
+        std::min(scope.detail, static_cast<int>(ProfileDetail::CONTENT)));
+
+    // Keep collecting this much detail for a while, so that revalidating
+    // doesn't lose anything queries needed before the restart.
+    cache.collectionDetail(entry->detail);
+
+    if (scope.scope.empty()) {
+      restored->absent = entry;
+    } else {
+      restored->entries[scope.scope] = entry;
+      usernames.push_back(userForScope(scope.scope));
+    }
+  }
 
-    // Send stdout/stderr to the file.
-    dup2(fd, STDOUT_FILENO);
-    dup2(fd, STDERR_FILENO);
+  cache.addUsers(usernames);
+  cache.restore(restored);
 
-    // Don't need the original FD any more.
-    close(fd);
+  LOG(INFO) << "restored profiles for " << restored->entries.size()
+            << " scopes from a snapshot " << age << " seconds old";
+  ExtensionStats::add(ExtensionStats::SNAPSHOT_LOAD_AGE_S, age);
+  return true;
+}
 
-    // Close all FDs after stderr.
-    closeFrom(STDERR_FILENO + 1);
 
-    // Run the subprocess (never returns)
-    execv(arguments[0], &arguments[0]);
-    _exit(100);
+/*
+ * This service saves the cached profiles to --profiles_snapshot_path every
+ * kSnapshotSaveInterval, if they have changed.
+ */
+class SnapshotSaver : public InternalRunnable {
+ public:
+  void start() override {
+    while (!interrupted()) {
+      interruptableSleep(kSnapshotSaveInterval * 1000);
+      saveSnapshot();
+    }
   }
 
-  // If we reach here, we're in the parent process.
-
-  // Wait for the subprocess to exit.
-  int status;
-  if (waitpid(p, &status, 0) == -1) {
-    return Status(1, "waitpid failed");
-  }
+ private:
+  static const size_t kSnapshotSaveInterval = 30;
+};
 
-  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-    return Status(1, "subprocess errored");
-  }
 
-  // Read the output of the subprocess if there's no error.
-  std::ifstream ifs (tempFileStr, std::ios::in | std::ios::binary);
-  if (!ifs) {
-    return Status(1, "couldn't read temp file");
-  }
+/*
+ * This service collects fresh profiles for every scope in a restored
+ * snapshot, and then stops serving the snapshot.
+ */
+class SnapshotRevalidator : public InternalRunnable {
+ public:
+  void start() override {
+    auto& cache = ProfileCache::instance();
+    const auto detail = cache.collectionDetail(ProfileDetail::PROFILE);
 
-  const auto sz = fs::file_size(tempFile);
-  output.clear();
-  output.reserve(sz);
+    try {
+      loadScopesFresh(cache.users(), detail);
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "revalidating profiles snapshot failed: " << e.what();
+    }
 
-  while (!ifs.eof()) {
-    output += ifs.get();
+    cache.clearRestored();
+    saveSnapshot();
   }
-
-  // All done!
-  fs::remove(tempFile);
-  return Status(0, "OK");
-}
+};
 
 
 /*
- * Helper function, mostly copied from osquery's source code.
- *
- * This function extracts a list of usernames given in the input query.
+ * This helper function returns a hash of everything in the given cache
+ * snapshot, which only changes when some scope's profiles do.
  */
-QueryData usersFromContext(const QueryContext& context, bool all = false) {
-  QueryData users;
+uint64_t snapshotHash(const ProfileCache::Snapshot& snapshot) {
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](uint64_t value) {
+    for (int i = 0; i < 8; i++, value >>= 8) {
+      hash = (hash ^ (value & 0xFF)) * 1099511628211ULL;
+    }
+  };
+  auto mixEntry = [&mix](const ProfileCache::Entry& entry) {
+    mix(static_cast<uint64_t>(entry.status.getCode()));
+    mix(entry.columns.profiles());
+    for (const auto profile : entry.columns.hash) {
+      mix(profile);
+    }
+  };
 
-  // If the user gave a 'username' constraint, get the user with that username
-  // (this will helpfully also not do anything if the user does not exist).
-  if (context.hasConstraint("username", EQUALS)) {
-    context.forEachConstraint(
-        "username",
-        EQUALS,
-        ([&users](const std::string& expr) {
-          auto user = SQL::selectAllFrom("users", "username", EQUALS, expr);
-          users.insert(users.end(), user.begin(), user.end());
-        }));
-  } else if (!all) {
-    // The user did not give a username, and did not want everything - return
-    // ourselves.
-    users =
-        SQL::selectAllFrom("users", "uid", EQUALS, std::to_string(getuid()));
-  } else {
-    // Return all users.
-    users = SQL::selectAllFrom("users");
+  for (const auto& it : snapshot.entries) {
+    mix(std::hash<std::string>()(it.first));
+    mixEntry(*it.second);
   }
-  return users;
+  if (snapshot.absent != nullptr) {
+    mixEntry(*snapshot.absent);
+  }
+  return hash;
 }
 
 
 /*
- * This helper function will parse the output of the `profiles` command and
- * call the given callback with each parsed result.
+ * This service collects the profiles of every user that has been asked for
+ * (and the system-wide profiles) every --profiles_refresh_interval seconds,
+ * whether or not they're cached, so that queries find a warm cache instead of
+ * waiting for /usr/bin/profiles.  For this to work, the interval should be a
+ * little less than both --profiles_cache_ttl and the interval of the scheduled
+ * queries against these tables.
+ *
+ * While the profile store watcher is running, changes are noticed through it
+ * rather than by refreshing, so the refresher backs off: while successive
+ * refreshes find nothing changed, the interval doubles (up to
+ * --profiles_refresh_max_interval).  It drops back to
+ * --profiles_refresh_interval as soon as a refresh finds a change, or anything
+ * in the cache is invalidated (i.e. the watcher saw a change, or stopped), in
+ * which case the next refresh starts straight away.  Without the watcher,
+ * refreshing is the only way changes are noticed, so it never backs off.
  */
-template<typename Fn>
-Status parseProfile(const std::string& commandOutput, const std::string& username, Fn callback) {
-  // Handle the case where the user does not exist.
-  if (boost::starts_with(commandOutput, "profiles: the user could not be found")) {
-    return Status(1, "User not found");
+class ProfileRefresher : public InternalRunnable {
+ public:
+  void start() override {
+    auto& cache = ProfileCache::instance();
+    const auto baseInterval = FLAGS_profiles_refresh_interval;
+    const auto maxInterval = std::max(FLAGS_profiles_refresh_max_interval, baseInterval);
+
+    auto interval = baseInterval;
+    bool first = true;
+    uint64_t lastHash = 0;
+    while (!interrupted()) {
+      const auto invalidations = cache.invalidations();
+      const auto hash = refresh();
+
+      if (first || hash != lastHash || cache.invalidations() != invalidations || !cache.watched()) {
+        interval = baseInterval;
+      } else if (interval < maxInterval) {
+        interval = std::min(interval * 2, maxInterval);
+        VLOG(1) << "profiles unchanged, refreshing every " << interval << " seconds";
+      }
+      first = false;
+      lastHash = hash;
+
+      if (!wait(interval)) {
+        interval = baseInterval;
+      }
+    }
   }
 
-  // The root key of the plist is either the username, or the literal string
-  // "_computerlevel" for system-wide profiles.
-  std::string rootKey;
-  if (username.length() > 0) {
-    rootKey = username;
-  } else {
-    rootKey = "_computerlevel";
+  // Don't hold up shutdown waiting for a hung /usr/bin/profiles.
+  void stop() override {
+    cancelCommands();
   }
 
-  pt::ptree tree;
-  if (parsePlistContent(commandOutput, tree).ok()) {
-    pt::ptree root;
+ private:
+  // Refreshes every scope, and returns a hash of the result.
+  uint64_t refresh() {
+    auto& cache = ProfileCache::instance();
+    const auto detail = cache.collectionDetail(ProfileDetail::PROFILE);
 
     try {
-      root = tree.get_child(rootKey);
-    } catch (const pt::ptree_bad_path&) {
-      return Status(1, "No profiles");
+      loadScopesFresh(cache.users(), detail, [this]() { return interrupted(); });
+    } catch (const std::exception& e) {
+      LOG(ERROR) << "refreshing profiles failed: " << e.what();
     }
 
-    for (const auto& it : root) {
-      auto profile = it.second;
-      callback(username, profile);
-    }
+    saveSnapshot();
+    return snapshotHash(*cache.snapshot());
   }
 
-  return Status(0, "OK");
-}
+  // Sleeps for the given number of seconds, and returns false if it was cut
+  // short because the cache was invalidated.
+  bool wait(uint64_t seconds) {
+    const auto invalidations = ProfileCache::instance().invalidations();
+    for (uint64_t i = 0; i < seconds && !interrupted(); i++) {
+      interruptableSleep(1000);
+      if (ProfileCache::instance().invalidations() != invalidations) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
 
 
 /*
- * This helper function will extract all usernames from the given context (if
- * any), run the `profiles` tool to retrieve all profiles for those users, and
- * then call the given callback with the resulting parsed profile data.
+ * This helper function returns the usernames whose profiles the given
+ * request is for, where "" stands for the system-wide profiles.
  */
-template<typename Fn>
-Status iterateProfiles(QueryContext& request, Fn callback) {
-  std::string commandOutput;
-
+std::vector<std::string> usernamesForRequest(QueryContext& request) {
   // If the caller is requesting a join against the user, then we generate
   // information from that user - otherwise, we grab the system-wide
   // profiles.
+  std::vector<std::string> usernames;
   if (request.constraints["username"].notExistsOrMatches("")) {
-    // Get system profiles
-    if (runCommand({"/usr/bin/profiles", "-C", "-o", "stdout-xml"}, commandOutput).ok()) {
-      auto result = parseProfile(commandOutput, "", callback);
-      if (!result.ok()) {
-        return result;
-      }
-    }
+    usernames.push_back("");
   } else {
     auto users = usersFromContext(request);
     for (const auto& row : users) {
       if (row.count("username") > 0) {
-        auto username = row.at("username");
-        std::vector<std::string> command = {"/usr/bin/profiles", "-L", "-o", "stdout-xml", "-U", username};
-
-        if (runCommand(command, commandOutput).ok()) {
-          auto result = parseProfile(commandOutput, username, callback);
-          if (!result.ok()) {
-            return result;
-          }
-        }
+        usernames.push_back(row.at("username"));
       }
     }
   }
+  return usernames;
+}
+
+
+/*
+ * This helper function will extract all usernames from the given context (if
+ * any), retrieve all profiles for those users, and then call the given
+ * callback with each user and the cache entry holding their profiles.  The
+ * profiles may be missing anything beyond the given detail.
+ *
+ * NOTE: The entry is only guaranteed to stay alive until the callback returns
+ * - copy anything that is needed for longer.
+ */
+template<typename Fn>
+Status iterateEntries(QueryContext& request, ProfileDetail detail, Fn callback) {
+  auto usernames = usernamesForRequest(request);
+  auto entries = loadScopes(usernames, detail);
+  for (size_t i = 0; i < usernames.size(); i++) {
+    // Scopes where the command failed are skipped.
+    if (entries[i] == nullptr) {
+      continue;
+    }
+
+    if (!entries[i]->status.ok()) {
+      return entries[i]->status;
+    }
+
+    callback(usernames[i], *entries[i]);
+  }
 
   return Status(0, "OK");
 }
 
 
+/*
+ * This helper function is like iterateEntries(), but calls the callback for
+ * each profile with one of the given identifiers.  The profiles are looked up
+ * by identifier rather than by checking every one, and the callback is given
+ * the cache entry and the profile's position in it.
+ */
+template<typename Fn>
+Status iterateProfilesById(QueryContext& request,
+                           ProfileDetail detail,
+                           const std::set<std::string>& identifiers,
+                           Fn callback) {
+  return iterateEntries(request, detail, [&](const std::string& username, const ProfileCache::Entry& entry) {
+    for (const auto& identifier : identifiers) {
+      entry.columns.forEachWithIdentifier(identifier, [&](size_t index) {
+        callback(username, entry, index);
+      });
+    }
+  });
+}
+
+
+/*
+ * This class builds the rows of a table's results.  A Row is a std::map, so
+ * every column still costs a node and a copy of its name, but the rest of the
+ * per-row work is avoided: columns that are set in sorted order are appended
+ * with a hint rather than looked up, values are moved in, and the results grow
+ * geometrically from the number of rows the caller expects.
+ */
+class RowBuilder {
+ public:
+  /*
+   * The given column names must be sorted; columns are referred to by their
+   * position in this list.
+   */
+  RowBuilder(QueryData& results, std::initializer_list<const char*> columns)
+      : results_(results), columns_(columns.begin(), columns.end()) {}
+
+  /*
+   * Makes room for at least `rows` more rows.
+   */
+  void reserve(size_t rows) {
+    const auto wanted = results_.size() + rows;
+    if (wanted > results_.capacity()) {
+      results_.reserve(std::max(wanted, 2 * results_.capacity()));
+    }
+  }
+
+  /*
+   * Starts a new row at the end of the results.
+   */
+  void add() {
+    results_.emplace_back();
+  }
+
+  void set(size_t column, std::string value) {
+    auto& row = results_.back();
+    row.emplace_hint(row.end(), columns_[column], std::move(value));
+  }
+
+  // Sets an INTEGER column that holds a flag.  This isn't an overload of
+  // set(): a string literal would silently pick the bool one.
+  void setFlag(size_t column, bool value) {
+    set(column, std::string(value ? "1" : "0"));
+  }
+
+ private:
+  QueryData& results_;
+  const std::vector<std::string> columns_;
+};
+
+
 /*
  * This table plugin creates the `profiles` table, which returns all
  * configuration profiles that are currently installed on the system.
@@ -268,42 +2085,174 @@ class ProfilesTablePlugin : public TablePlugin {
     };
   }
 
+  // Columns in sorted order, for RowBuilder.
+  enum Column : size_t {
+    DESCRIPTION,
+    DISPLAY_NAME,
+    IDENTIFIER,
+    ORGANIZATION,
+    REMOVAL_ALLOWED,
+    TYPE,
+    USERNAME,
+    VERIFIED,
+  };
+
   QueryData generate(QueryContext& request) {
     QueryData results;
+    RowBuilder rows(results, {"description", "display_name", "identifier", "organization",
+                              "removal_allowed", "type", "username", "verified"});
+    ColumnFilter filter(request, {"identifier", "type", "organization", "verified"});
 
     // NOTE: If there's an error, we just ignore it and return the current set
     // of results.
-    iterateProfiles(request, [&](const std::string& username, pt::ptree& profile) {
-      Row r;
-      r["username"] = username;
-      r["identifier"] = profile.get<std::string>("ProfileIdentifier", "");
-      r["display_name"] = profile.get<std::string>("ProfileDisplayName", "");
-      r["description"] = profile.get<std::string>("ProfileDescription", "");
-      r["organization"] = profile.get<std::string>("ProfileOrganization", "");
-      r["type"] = profile.get<std::string>("ProfileType", "");
-
-      if (profile.get<std::string>("ProfileVerificationState", "") == "verified") {
-        r["verified"] = INTEGER(1);
-      } else {
-        r["verified"] = INTEGER(0);
-      }
+    iterateEntries(request, ProfileDetail::PROFILE, [&](const std::string& username, const ProfileCache::Entry& entry) {
+      const auto& columns = entry.columns;
+      rows.reserve(columns.profiles());
+
+      for (size_t i = 0; i < columns.profiles(); i++) {
+        const auto& identifier = columns.str(columns.identifier[i]);
+        const auto& type = columns.str(columns.type[i]);
+        const auto& organization = columns.str(columns.organization[i]);
+        const bool verified = columns.verified[i];
+
+        if (!filter.matches("identifier", identifier) ||
+            !filter.matches("type", type) ||
+            !filter.matches("organization", organization) ||
+            !filter.matches("verified", verified ? 1LL : 0LL)) {
+          continue;
+        }
 
-      // The flag is actually 'ProfileRemovalDisallowed', which is set to 'true' when the
-      // profile cannot be removed.
-      if (profile.get<std::string>("ProfileRemovalDisallowed", "") == "true") {
-        r["removal_allowed"] = INTEGER(0);
-      } else {
-        r["removal_allowed"] = INTEGER(1);
-      }
+        rows.add();
+        rows.set(DESCRIPTION, columns.str(columns.description[i]));
+        rows.set(DISPLAY_NAME, columns.str(columns.displayName[i]));
+        rows.set(IDENTIFIER, identifier);
+        rows.set(ORGANIZATION, organization);
 
-      results.push_back(r);
+        // The flag is actually 'ProfileRemovalDisallowed', which is set to 'true' when the
+        // profile cannot be removed.
+        rows.setFlag(REMOVAL_ALLOWED, !columns.removalDisallowed[i]);
+
+        rows.set(TYPE, type);
+        rows.set(USERNAME, username);
+        rows.setFlag(VERIFIED, verified);
+      }
     });
 
+    ExtensionStats::add(ExtensionStats::ROWS_PROFILES, results.size());
     return results;
   }
 };
 
 
+/*
+ * This helper function renders the given PayloadContent as JSON.
+ */
+std::string renderContent(const PlistTree& content) {
+  std::string rendered;
+  encodeJson(content, FLAGS_profiles_typed_content, rendered);
+  return rendered;
+}
+
+
+/*
+ * This class caches the JSON rendering of payload contents, keyed by the hash
+ * of the content.  Contents are kept encoded in the profile cache and are only
+ * decoded and rendered the first time a query reads them; after that, the
+ * rendering is kept for as long as any cached entry holds the same content,
+ * so that it survives refreshes that don't change it and is shared between
+ * scopes.
+ *
+ * The cache holds at most --profiles_content_cache_size renderings; anything
+ * beyond that is rendered every time.
+ */
+class ContentCache {
+ public:
+  static ContentCache& instance() {
+    static ContentCache cache;
+    return cache;
+  }
+
+  std::string render(uint64_t hash, const ProfileColumns& columns, size_t payload) {
+    // Typed and untyped renderings of the same content are different.
+    const auto key = FLAGS_profiles_typed_content ? ~hash : hash;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      prune();
+      auto it = rendered_.find(key);
+      if (it != rendered_.end()) {
+        return it->second;
+      }
+    }
+
+    PlistTree content;
+    if (!columns.content(payload, content)) {
+      return std::string();
+    }
+    auto rendered = renderContent(content);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (rendered_.size() < FLAGS_profiles_content_cache_size) {
+      rendered_.emplace(key, rendered);
+    }
+    return rendered;
+  }
+
+  // Drops every cached rendering.
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rendered_.clear();
+  }
+
+ private:
+  ContentCache() = default;
+
+  // Drops the rendering of every content that is no longer in the profile
+  // cache, if it has changed since the last time.  Must be called with
+  // `mutex_` held.
+  void prune() {
+    auto& cache = ProfileCache::instance();
+    auto current = cache.snapshot();
+    if (current->version == version_) {
+      return;
+    }
+    version_ = current->version;
+
+    std::unordered_set<uint64_t> live;
+    auto addEntry = [&live](const ProfileCache::EntryRef& entry) {
+      if (entry != nullptr) {
+        live.insert(entry->columns.contentHash.begin(), entry->columns.contentHash.end());
+      }
+    };
+    auto addSnapshot = [&addEntry](const ProfileCache::SnapshotRef& snapshot) {
+      if (snapshot == nullptr) {
+        return;
+      }
+      for (const auto& it : snapshot->entries) {
+        addEntry(it.second);
+      }
+      addEntry(snapshot->absent);
+    };
+    addSnapshot(current);
+    addSnapshot(cache.restored());
+
+    for (auto it = rendered_.begin(); it != rendered_.end();) {
+      if (live.count(it->first) == 0 && live.count(~it->first) == 0) {
+        it = rendered_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, std::string> rendered_;
+
+  // The profile cache version that `rendered_` was last pruned against.
+  uint64_t version_ = 0;
+};
+
+
 /*
  * This table plugin creates the `profile_items` table, which returns all
  * items in the given configuration profile.
@@ -320,65 +2269,274 @@ class ProfileItemsTablePlugin : public TablePlugin {
       std::make_tuple("description", TEXT_TYPE, ColumnOptions::DEFAULT),
       std::make_tuple("organization", TEXT_TYPE, ColumnOptions::DEFAULT),
       std::make_tuple("content", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("content_hash", TEXT_TYPE, ColumnOptions::DEFAULT),
 
       // TODO: add a 'version' column with the 'PayloadVersion' key?
       //std::make_tuple("version", INTEGER_TYPE, ColumnOptions::DEFAULT),
     };
   }
 
+  // Columns in sorted order, for RowBuilder.
+  enum Column : size_t {
+    CONTENT,
+    CONTENT_HASH,
+    DESCRIPTION,
+    DISPLAY_NAME,
+    IDENTIFIER,
+    ORGANIZATION,
+    PROFILE_IDENTIFIER,
+    TYPE,
+    USERNAME,
+  };
+
   QueryData generate(QueryContext& request) {
     QueryData results;
+    RowBuilder rows(results, {"content", "content_hash", "description", "display_name", "identifier",
+                              "organization", "profile_identifier", "type", "username"});
 
-    // All profiles we want to read.
+    // All profiles we want to read.  This table only returns anything for
+    // profiles that have been asked for, so if there aren't any we don't need
+    // to collect anything either.
     auto wantedProfiles = request.constraints["profile_identifier"].getAll(EQUALS);
+    if (wantedProfiles.empty()) {
+      VLOG(1) << "no profile_identifier given, returning no profile items";
+      return results;
+    }
+
+    // Rendering (and even parsing) the content is most of the work, so skip it
+    // unless it's been asked for.
+    const bool wantContent = request.isColumnUsed("content");
+    const bool wantHash = request.isColumnUsed("content_hash");
+    const auto detail = (wantContent || wantHash) ? ProfileDetail::CONTENT : ProfileDetail::ITEMS;
+
+    ColumnFilter filter(request, {"type", "identifier"});
 
     // For all profiles that match our constraints...
     // NOTE: If there's an error, we just ignore it and return the current set
     // of results.
-    iterateProfiles(request, [&](const std::string& username, pt::ptree& profile) {
-      // Get this profile's identifier.
-      auto identifier = profile.get<std::string>("ProfileIdentifier", "");
+    iterateProfilesById(request, detail, wantedProfiles, [&](const std::string& username, const ProfileCache::Entry& entry, size_t index) {
+      const auto& columns = entry.columns;
+      const auto& identifier = columns.str(columns.identifier[index]);
+
+      const auto begin = columns.payloadsBegin[index];
+      const auto end = columns.payloadsBegin[index + 1];
+      rows.reserve(end - begin);
+
+      for (auto payload = begin; payload < end; payload++) {
+        const auto hash = columns.contentHash[payload];
+        const auto& type = columns.str(columns.payloadType[payload]);
+        const auto& payloadIdentifier = columns.str(columns.payloadIdentifier[payload]);
+        if (!filter.matches("type", type) || !filter.matches("identifier", payloadIdentifier)) {
+          continue;
+        }
 
-      // If we don't care about this profile, we just continue.
-      if (wantedProfiles.find(identifier) == wantedProfiles.end()) {
-        return;
-      }
+        rows.add();
 
-      // Find all payloads in this profile, continuing if there are none.
-      pt::ptree payloads;
-      try {
-        payloads = profile.get_child("ProfileItems");
-      } catch (const pt::ptree_bad_path&) {
-        return;
+        // An item without a PayloadContent has no hash.
+        if (wantContent) {
+          rows.set(CONTENT, (hash != 0) ? ContentCache::instance().render(hash, columns, payload) : std::string());
+        }
+
+        if (wantHash) {
+          rows.set(CONTENT_HASH, (hash != 0) ? hashString(hash) : std::string());
+        }
+
+        rows.set(DESCRIPTION, columns.str(columns.payloadDescription[payload]));
+        rows.set(DISPLAY_NAME, columns.str(columns.payloadDisplayName[payload]));
+        rows.set(IDENTIFIER, payloadIdentifier);
+        rows.set(ORGANIZATION, columns.str(columns.payloadOrganization[payload]));
+        rows.set(PROFILE_IDENTIFIER, identifier);
+        rows.set(TYPE, type);
+        rows.set(USERNAME, username);
       }
+    });
+
+    ExtensionStats::add(ExtensionStats::ROWS_PROFILE_ITEMS, results.size());
+    return results;
+  }
+};
+
+/*
+ * This table plugin creates the `profile_changes` table, which returns a log
+ * of the profiles that have been added, removed or changed, oldest first.
+ * Every profile is identified by a hash of its full contents, including its
+ * payloads and ProfileVersion.
+ *
+ * Changes are found by comparing each query's collection with the previous
+ * one for the same users, and every change is kept (up to
+ * --profiles_changes_history of them) with a sequence number and the time it
+ * was seen.  Reading the table doesn't consume anything, so any number of
+ * queries can use it: a scheduled differential query only logs the new rows,
+ * and an ad-hoc query can select e.g. `WHERE sequence > 42`.
+ *
+ * The first query for a user reports each profile as 'added', and so does the
+ * first query after the extension restarts.
+ */
+class ProfileChangesTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() const {
+    return {
+      std::make_tuple("sequence", BIGINT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("time", BIGINT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("username", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("identifier", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("display_name", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("version", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("action", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("hash", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("previous_hash", TEXT_TYPE, ColumnOptions::DEFAULT),
+    };
+  }
+
+  struct Seen {
+    uint64_t hash;
+    std::string displayName;
+    std::string version;
+  };
+
+  // Profile identifier => what we saw last time.
+  using ScopeState = std::map<std::string, Seen>;
+
+  struct Change {
+    uint64_t sequence;
+    uint64_t time;
+    std::string username;
+    std::string identifier;
+    Seen seen;
+    std::string action;
+
+    // The profile's hash before it changed, if it was seen before.
+    bool hasPrevious;
+    uint64_t previousHash;
+  };
+
+  QueryData generate(QueryContext& request) {
+    QueryData results;
 
-      for (const auto& it : payloads) {
-        auto payload = it.second;
+    auto usernames = usernamesForRequest(request);
+    auto entries = loadScopes(usernames, ProfileDetail::CONTENT);
+    const uint64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
 
-        Row r;
-        r["profile_identifier"] = identifier;
-        r["type"] = payload.get<std::string>("PayloadType", "");
-        r["identifier"] = payload.get<std::string>("PayloadIdentifier", "");
-        r["display_name"] = payload.get<std::string>("PayloadDisplayName", "");
-        r["description"] = payload.get<std::string>("PayloadDescription", "");
-        r["organization"] = payload.get<std::string>("PayloadOrganization", "");
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < usernames.size(); i++) {
+      // If we couldn't collect a scope, we can't say what changed in it.
+      if (entries[i] == nullptr) {
+        continue;
+      }
 
-        std::string content;
-        try {
-          std::ostringstream buf;
-          pt::write_json(buf, payload.get_child("PayloadContent"), false);
-          buf.flush();
+      ScopeState current;
+      if (entries[i]->status.ok()) {
+        const auto& columns = entries[i]->columns;
+        for (size_t j = 0; j < columns.profiles(); j++) {
+          current[columns.str(columns.identifier[j])] = Seen{
+            columns.hash[j],
+            columns.str(columns.displayName[j]),
+            columns.str(columns.version[j]),
+          };
+        }
+      }
 
-          content = buf.str();
-        } catch (const pt::ptree_bad_path&) {
-          // Do nothing.
+      auto& previous = state_[scopeForUser(usernames[i])];
+      for (const auto& it : current) {
+        auto old = previous.find(it.first);
+        if (old == previous.end()) {
+          record(now, usernames[i], it.first, it.second, "added", nullptr);
+        } else if (old->second.hash != it.second.hash) {
+          record(now, usernames[i], it.first, it.second, "changed", &old->second);
+        }
+      }
+      for (const auto& it : previous) {
+        if (current.count(it.first) == 0) {
+          record(now, usernames[i], it.first, it.second, "removed", &it.second);
         }
+      }
 
-        boost::algorithm::trim_right(content);
-        r["content"] = content;
-        results.push_back(r);
+      previous = std::move(current);
+    }
+
+    while (history_.size() > FLAGS_profiles_changes_history) {
+      history_.pop_front();
+    }
+
+    const std::set<std::string> requested(usernames.begin(), usernames.end());
+    for (const auto& change : history_) {
+      if (requested.count(change.username) > 0) {
+        results.push_back(makeRow(change));
       }
+    }
+
+    ExtensionStats::add(ExtensionStats::ROWS_PROFILE_CHANGES, results.size());
+    return results;
+  }
+
+  void record(uint64_t time,
+              const std::string& username,
+              const std::string& identifier,
+              const Seen& seen,
+              const std::string& action,
+              const Seen* before) {
+    history_.push_back(Change{
+      ++sequence_,
+      time,
+      username,
+      identifier,
+      seen,
+      action,
+      before != nullptr,
+      (before != nullptr) ? before->hash : 0,
     });
+  }
+
+  static Row makeRow(const Change& change) {
+    Row r;
+    r["sequence"] = BIGINT(change.sequence);
+    r["time"] = BIGINT(change.time);
+    r["username"] = change.username;
+    r["identifier"] = change.identifier;
+    r["display_name"] = change.seen.displayName;
+    r["version"] = change.seen.version;
+    r["action"] = change.action;
+    r["hash"] = (change.action == "removed") ? "" : hashString(change.seen.hash);
+    r["previous_hash"] = change.hasPrevious ? hashString(change.previousHash) : "";
+    return r;
+  }
+
+  std::mutex mutex_;
+
+  // Scope => the profiles seen in it by the last query.
+  std::map<std::string, ScopeState> state_;
+
+  // The most recent changes, oldest first, and the last sequence number used.
+  std::deque<Change> history_;
+  uint64_t sequence_ = 0;
+};
+
+/*
+ * This table plugin creates the `profiles_extension_stats` table, which
+ * returns the extension's internal counters and timers (since it started), so
+ * that its cost can be watched through osquery itself.
+ */
+class ProfilesExtensionStatsTablePlugin : public TablePlugin {
+ private:
+  TableColumns columns() const {
+    return {
+      std::make_tuple("name", TEXT_TYPE, ColumnOptions::DEFAULT),
+      std::make_tuple("value", BIGINT_TYPE, ColumnOptions::DEFAULT),
+    };
+  }
+
+  QueryData generate(QueryContext& request) {
+    QueryData results;
+
+    for (int i = 0; i < ExtensionStats::NUM_COUNTERS; i++) {
+      const auto counter = static_cast<ExtensionStats::Counter>(i);
+
+      Row r;
+      r["name"] = ExtensionStats::name(counter);
+      r["value"] = BIGINT(ExtensionStats::get(counter));
+      results.push_back(std::move(r));
+    }
 
     return results;
   }
@@ -386,17 +2544,41 @@ class ProfileItemsTablePlugin : public TablePlugin {
 
 REGISTER_EXTERNAL(ProfilesTablePlugin, "table", "profiles");
 REGISTER_EXTERNAL(ProfileItemsTablePlugin, "table", "profile_items");
+REGISTER_EXTERNAL(ProfileChangesTablePlugin, "table", "profile_changes");
+REGISTER_EXTERNAL(ProfilesExtensionStatsTablePlugin, "table", "profiles_extension_stats");
 
 int main(int argc, char* argv[]) {
   osquery::Initializer runner(argc, argv, ToolType::EXTENSION);
 
-  // Connect to osqueryi or osqueryd.
+  // Load the last run's profiles before anything can query them.
+  const bool restored = !FLAGS_profiles_snapshot_path.empty() && restoreSnapshot();
+
+  // Connect to osqueryi or osqueryd.  osquery may call into the extension from
+  // several threads at once, so every table must be safe to generate
+  // concurrently: they read the shared cache snapshot, and concurrent
+  // collections of the same scope are coalesced.
   auto status = startExtension("profiles", "0.0.1");
   if (!status.ok()) {
     LOG(ERROR) << status.getMessage();
     runner.requestShutdown(status.getCode());
   }
 
+  if (FLAGS_profiles_watch_store && FLAGS_profiles_cache_ttl > 0) {
+    Dispatcher::addService(std::make_shared<ProfileStoreWatcher>());
+  }
+
+  if (FLAGS_profiles_refresh_interval > 0 && FLAGS_profiles_cache_ttl > 0) {
+    Dispatcher::addService(std::make_shared<ProfileRefresher>());
+  }
+
+  if (restored) {
+    Dispatcher::addService(std::make_shared<SnapshotRevalidator>());
+  }
+
+  if (!FLAGS_profiles_snapshot_path.empty()) {
+    Dispatcher::addService(std::make_shared<SnapshotSaver>());
+  }
+
   // Finally wait for a signal / interrupt to shutdown.
   runner.waitForShutdown();
   return 0;
@@ -0,0 +1,512 @@
+#include "plist_stream.h"
+
+#include <cctype>
+#include <cstring>
+#include <ctime>
+
+using namespace osquery;
+
+
+namespace {
+
+/*
+ * The plist elements we know about.  Anything else is an error, since Apple's
+ * plist DTD is fixed.
+ */
+enum class Element {
+  PLIST,
+  DICT,
+  ARRAY,
+  KEY,
+  STRING,
+  INTEGER,
+  REAL,
+  DATE,
+  DATA,
+  TRUE_VALUE,
+  FALSE_VALUE,
+  UNKNOWN,
+};
+
+struct Tag {
+  Element element;
+
+  // </foo>
+  bool closing;
+
+  // <foo/>
+  bool empty;
+};
+
+
+/*
+ * This class reads a plist one tag at a time.  Values are either converted
+ * into a tree node, or (if the node is nullptr) skipped over without
+ * allocating anything.
+ */
+class PlistReader {
+ public:
+  explicit PlistReader(const std::string& content)
+      : begin_(content.data()),
+        pos_(content.data()),
+        end_(content.data() + content.size()) {}
+
+  Status parse(const std::set<std::string>& skipPaths, const ProfileCallback& callback) {
+    skipPaths_ = &skipPaths;
+
+    Tag tag;
+    if (!nextTag(tag)) {
+      return error("expected <plist>");
+    }
+    if (tag.element == Element::PLIST && !tag.closing) {
+      if (!nextTag(tag)) {
+        return error("expected <dict>");
+      }
+    }
+    if (tag.element != Element::DICT || tag.closing) {
+      return error("expected <dict>");
+    }
+    if (tag.empty) {
+      return Status(0, "OK");
+    }
+
+    // The root dictionary maps each scope to a list of profiles.
+    std::string scope;
+    while (true) {
+      if (!nextTag(tag)) {
+        return error("unterminated <dict>");
+      }
+      if (tag.element == Element::DICT && tag.closing) {
+        break;
+      }
+      if (tag.element != Element::KEY || tag.closing || !readText(tag, &scope)) {
+        return error("expected <key>");
+      }
+
+      if (!nextTag(tag) || tag.closing) {
+        return error("expected a value");
+      }
+      if (tag.element != Element::ARRAY) {
+        if (!readValue(tag, nullptr)) {
+          return error("malformed value");
+        }
+        continue;
+      }
+      if (tag.empty) {
+        continue;
+      }
+
+      while (true) {
+        if (!nextTag(tag)) {
+          return error("unterminated <array>");
+        }
+        if (tag.element == Element::ARRAY && tag.closing) {
+          break;
+        }
+        if (tag.closing) {
+          return error("unexpected closing tag");
+        }
+
+        if (tag.element != Element::DICT) {
+          if (!readValue(tag, nullptr)) {
+            return error("malformed value");
+          }
+          continue;
+        }
+
+        PlistTree profile;
+        path_.clear();
+        if (!readDict(tag, &profile)) {
+          return error("malformed profile");
+        }
+        callback(scope, profile);
+      }
+    }
+
+    return Status(0, "OK");
+  }
+
+ private:
+  Status error(const std::string& message) const {
+    return Status(1, "Malformed plist at offset " + std::to_string(pos_ - begin_) + ": " + message);
+  }
+
+  static Element elementFor(const char* name, size_t length) {
+    static const struct {
+      const char* name;
+      Element element;
+    } kElements[] = {
+      {"plist", Element::PLIST},
+      {"dict", Element::DICT},
+      {"array", Element::ARRAY},
+      {"key", Element::KEY},
+      {"string", Element::STRING},
+      {"integer", Element::INTEGER},
+      {"real", Element::REAL},
+      {"date", Element::DATE},
+      {"data", Element::DATA},
+      {"true", Element::TRUE_VALUE},
+      {"false", Element::FALSE_VALUE},
+    };
+
+    for (const auto& it : kElements) {
+      if (strlen(it.name) == length && memcmp(it.name, name, length) == 0) {
+        return it.element;
+      }
+    }
+    return Element::UNKNOWN;
+  }
+
+  // Moves to the next tag, skipping over the XML declaration, DOCTYPE,
+  // comments and whitespace.
+  bool nextTag(Tag& tag) {
+    while (true) {
+      pos_ = static_cast<const char*>(memchr(pos_, '<', end_ - pos_));
+      if (pos_ == nullptr) {
+        pos_ = end_;
+        return false;
+      }
+
+      if (startsWith("<!--")) {
+        if (!skipPast("-->")) {
+          return false;
+        }
+      } else if (startsWith("<?") || startsWith("<!")) {
+        if (!skipPast(">")) {
+          return false;
+        }
+      } else {
+        break;
+      }
+    }
+
+    pos_++;
+    tag.closing = (pos_ < end_ && *pos_ == '/');
+    if (tag.closing) {
+      pos_++;
+    }
+
+    const char* name = pos_;
+    while (pos_ < end_ && (isalnum(static_cast<unsigned char>(*pos_)) || *pos_ == '_' || *pos_ == '-')) {
+      pos_++;
+    }
+    tag.element = elementFor(name, pos_ - name);
+
+    // Skip any attributes, e.g. <plist version="1.0">.
+    const char* close = static_cast<const char*>(memchr(pos_, '>', end_ - pos_));
+    if (close == nullptr) {
+      return false;
+    }
+    tag.empty = (close > pos_ && close[-1] == '/');
+    pos_ = close + 1;
+
+    return tag.element != Element::UNKNOWN;
+  }
+
+  bool startsWith(const char* prefix) const {
+    size_t length = strlen(prefix);
+    return static_cast<size_t>(end_ - pos_) >= length && memcmp(pos_, prefix, length) == 0;
+  }
+
+  bool skipPast(const char* marker) {
+    size_t length = strlen(marker);
+    while (pos_ + length <= end_) {
+      if (memcmp(pos_, marker, length) == 0) {
+        pos_ += length;
+        return true;
+      }
+      pos_++;
+    }
+    return false;
+  }
+
+  // Reads the text content of the given tag (decoding entities), up to and
+  // including its closing tag.  If `out` is nullptr the text is skipped.
+  bool readText(const Tag& open, std::string* out) {
+    if (out != nullptr) {
+      out->clear();
+    }
+    if (open.empty) {
+      return true;
+    }
+
+    const char* start = pos_;
+    const char* stop = static_cast<const char*>(memchr(pos_, '<', end_ - pos_));
+    if (stop == nullptr) {
+      return false;
+    }
+
+    if (out != nullptr) {
+      if (memchr(start, '&', stop - start) == nullptr) {
+        out->assign(start, stop);
+      } else {
+        decodeEntities(start, stop, *out);
+      }
+    }
+
+    pos_ = stop;
+    Tag close;
+    return nextTag(close) && close.closing && close.element == open.element;
+  }
+
+  static void decodeEntities(const char* start, const char* stop, std::string& out) {
+    out.reserve(stop - start);
+
+    for (const char* p = start; p < stop; p++) {
+      if (*p != '&') {
+        out += *p;
+        continue;
+      }
+
+      const char* semi = static_cast<const char*>(memchr(p, ';', stop - p));
+      if (semi == nullptr) {
+        out += *p;
+        continue;
+      }
+
+      std::string entity(p + 1, semi);
+      if (entity == "lt") {
+        out += '<';
+      } else if (entity == "gt") {
+        out += '>';
+      } else if (entity == "amp") {
+        out += '&';
+      } else if (entity == "quot") {
+        out += '"';
+      } else if (entity == "apos") {
+        out += '\'';
+      } else if (entity.size() > 1 && entity[0] == '#') {
+        unsigned long cp = (entity[1] == 'x')
+            ? strtoul(entity.c_str() + 2, nullptr, 16)
+            : strtoul(entity.c_str() + 1, nullptr, 10);
+        appendUtf8(cp, out);
+      } else {
+        // Not an entity we know - keep it as-is.
+        out.append(p, semi + 1);
+      }
+      p = semi;
+    }
+  }
+
+  static void appendUtf8(unsigned long cp, std::string& out) {
+    if (cp < 0x80) {
+      out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      out += static_cast<char>(0xC0 | (cp >> 6));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      out += static_cast<char>(0xE0 | (cp >> 12));
+      out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+      out += static_cast<char>(0xF0 | (cp >> 18));
+      out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+  }
+
+  // Reads the value starting with the given (opening) tag into `node`.
+  bool readValue(const Tag& open, PlistTree* node) {
+    switch (open.element) {
+    case Element::DICT:
+      return readDict(open, node);
+
+    case Element::ARRAY:
+      return readArray(open, node);
+
+    case Element::TRUE_VALUE:
+    case Element::FALSE_VALUE:
+      if (node != nullptr) {
+        node->data().value = (open.element == Element::TRUE_VALUE) ? "true" : "false";
+        node->data().type = PlistType::BOOLEAN;
+      }
+      if (!open.empty) {
+        Tag close;
+        return nextTag(close) && close.closing && close.element == open.element;
+      }
+      return true;
+
+    case Element::STRING:
+    case Element::INTEGER:
+    case Element::REAL:
+    case Element::DATE:
+    case Element::DATA: {
+      if (node == nullptr) {
+        return readText(open, nullptr);
+      }
+
+      std::string value;
+      if (!readText(open, &value)) {
+        return false;
+      }
+      if (open.element == Element::DATE) {
+        value = convertDate(value);
+      } else if (open.element == Element::DATA) {
+        value = convertData(value);
+      }
+      node->data().value = std::move(value);
+      node->data().type = typeFor(open.element);
+      return true;
+    }
+
+    default:
+      return false;
+    }
+  }
+
+  static PlistType typeFor(Element element) {
+    switch (element) {
+    case Element::INTEGER:
+      return PlistType::INTEGER;
+    case Element::REAL:
+      return PlistType::REAL;
+    case Element::DATE:
+      return PlistType::DATE;
+    case Element::DATA:
+      return PlistType::DATA;
+    default:
+      return PlistType::STRING;
+    }
+  }
+
+  bool readDict(const Tag& open, PlistTree* node) {
+    if (node != nullptr) {
+      node->data().type = PlistType::DICT;
+    }
+    if (open.empty) {
+      return true;
+    }
+
+    // The path of our values is our own path plus the key.
+    const auto pathLength = path_.size();
+
+    std::string key;
+    Tag tag;
+    while (true) {
+      if (!nextTag(tag)) {
+        return false;
+      }
+      if (tag.element == Element::DICT && tag.closing) {
+        return true;
+      }
+      if (tag.element != Element::KEY || tag.closing) {
+        return false;
+      }
+
+      // We only need the key if we're keeping the value.
+      if (!readText(tag, node != nullptr ? &key : nullptr)) {
+        return false;
+      }
+
+      if (!nextTag(tag) || tag.closing) {
+        return false;
+      }
+
+      if (node == nullptr || isSkipped(key, pathLength)) {
+        bool ok = readValue(tag, nullptr);
+        path_.resize(pathLength);
+        if (!ok) {
+          return false;
+        }
+        continue;
+      }
+
+      auto& child = node->push_back(std::make_pair(key, PlistTree()))->second;
+      bool ok = readValue(tag, &child);
+      path_.resize(pathLength);
+      if (!ok) {
+        return false;
+      }
+    }
+  }
+
+  // Extends the current path (of length `pathLength`) with the given key, and
+  // returns true if the result is a path we were asked to skip.
+  bool isSkipped(const std::string& key, size_t pathLength) {
+    path_.resize(pathLength);
+    if (pathLength > 0) {
+      path_ += '.';
+    }
+    path_ += key;
+
+    return skipPaths_->count(path_) > 0;
+  }
+
+  bool readArray(const Tag& open, PlistTree* node) {
+    if (node != nullptr) {
+      node->data().type = PlistType::ARRAY;
+    }
+    if (open.empty) {
+      return true;
+    }
+
+    Tag tag;
+    while (true) {
+      if (!nextTag(tag)) {
+        return false;
+      }
+      if (tag.element == Element::ARRAY && tag.closing) {
+        return true;
+      }
+      if (tag.closing) {
+        return false;
+      }
+
+      PlistTree* child = nullptr;
+      if (node != nullptr) {
+        child = &node->push_back(std::make_pair(std::string(), PlistTree()))->second;
+      }
+      if (!readValue(tag, child)) {
+        return false;
+      }
+    }
+  }
+
+  // Plist dates are ISO 8601 in UTC; parsePlistContent() gives them as a
+  // UNIX timestamp.
+  static std::string convertDate(const std::string& value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value.c_str(), "%4d-%2d-%2dT%2d:%2d:%2dZ", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+      return value;
+    }
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return std::to_string(static_cast<long long>(timegm(&tm)));
+  }
+
+  // Plist data is base64, wrapped over several lines - we just drop the
+  // whitespace.
+  static std::string convertData(const std::string& value) {
+    std::string result;
+    result.reserve(value.size());
+    for (const auto c : value) {
+      if (!isspace(static_cast<unsigned char>(c))) {
+        result += c;
+      }
+    }
+    return result;
+  }
+
+  const char* begin_;
+  const char* pos_;
+  const char* end_;
+
+  const std::set<std::string>* skipPaths_{nullptr};
+
+  // The path of the value currently being converted, within its profile.
+  std::string path_;
+};
+
+}
+
+
+Status streamProfiles(const std::string& content,
+                      const std::set<std::string>& skipPaths,
+                      const ProfileCallback& callback) {
+  PlistReader reader(content);
+  return reader.parse(skipPaths, callback);
+}
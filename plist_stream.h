@@ -0,0 +1,30 @@
+#pragma once
+
+#include <functional>
+#include <set>
+#include <string>
+
+#include <osquery/status.h>
+
+#include "plist_tree.h"
+
+
+using ProfileCallback = std::function<void(const std::string& scope, PlistTree& profile)>;
+
+
+/*
+ * This function parses an XML plist in the format written by `profiles -o
+ * stdout-xml` - a dictionary from scope (a username, or "_computerlevel") to a
+ * list of profiles - and calls the given callback with each profile as soon as
+ * it has been parsed, rather than building a tree for the whole document.
+ *
+ * Values whose path (relative to the profile) is in `skipPaths` are skipped
+ * over without being converted.  A path is a list of keys separated by '.',
+ * where arrays don't count - e.g. "ProfileItems.PayloadContent" is the content
+ * of every item in a profile.  Everything else is converted the same way as by
+ * osquery's parsePlistContent(), and the callback is free to move from the
+ * profile it is given.
+ */
+osquery::Status streamProfiles(const std::string& content,
+                               const std::set<std::string>& skipPaths,
+                               const ProfileCallback& callback);
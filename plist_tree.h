@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+
+#include <boost/property_tree/ptree.hpp>
+
+
+/*
+ * The type a plist value had in the plist.  Dictionaries and arrays are tree
+ * nodes whose children are their values (with empty keys, for arrays).
+ */
+enum class PlistType : unsigned char {
+  STRING,
+  INTEGER,
+  REAL,
+  BOOLEAN,
+  DATE,
+  DATA,
+  DICT,
+  ARRAY,
+};
+
+
+/*
+ * A single plist value.  The value is converted to a string the same way as
+ * by osquery's parsePlistContent() (e.g. booleans are "true" or "false"), and
+ * is empty for dictionaries and arrays.
+ */
+struct PlistValue {
+  std::string value;
+  PlistType type = PlistType::STRING;
+};
+
+
+/*
+ * A parsed plist - the same property tree that parsePlistContent() builds,
+ * except that every node also remembers the type of its value.
+ */
+using PlistTree = boost::property_tree::basic_ptree<std::string, PlistValue>;
@@ -0,0 +1,231 @@
+#include "profile_columns.h"
+
+#include <numeric>
+
+
+namespace {
+
+// Returns the value of the given direct child of a profile or payload, or an
+// empty string if there isn't one.  Unlike ptree::get(), this doesn't copy the
+// value or treat '.' as a path separator.
+const std::string& childValue(const PlistTree& node, const std::string& key) {
+  static const std::string kEmpty;
+
+  auto it = node.find(key);
+  if (it == node.not_found()) {
+    return kEmpty;
+  }
+  return it->second.data().value;
+}
+
+}  // namespace
+
+
+bool ProfileColumns::content(size_t payload, PlistTree& tree) const {
+  const auto begin = contentBegin[payload];
+  const auto end = contentBegin[payload + 1];
+  if (begin == end) {
+    return false;
+  }
+
+  BinaryReader reader(contentBlob.data() + begin, static_cast<size_t>(end - begin));
+  return reader.tree(tree);
+}
+
+
+void ProfileColumns::serialize(BinaryWriter& writer) const {
+  writer.strings(strings);
+
+  writer.integers(identifier);
+  writer.integers(type);
+  writer.integers(displayName);
+  writer.integers(description);
+  writer.integers(organization);
+  writer.integers(version);
+  writer.integers(verified);
+  writer.integers(removalDisallowed);
+  writer.integers(hash);
+  writer.integers(payloadsBegin);
+
+  writer.integers(payloadType);
+  writer.integers(payloadIdentifier);
+  writer.integers(payloadDisplayName);
+  writer.integers(payloadDescription);
+  writer.integers(payloadOrganization);
+  writer.integers(contentHash);
+  writer.integers(contentBegin);
+  writer.string(contentBlob);
+
+  writer.integers(byIdentifier);
+}
+
+
+bool ProfileColumns::deserialize(BinaryReader& reader) {
+  bool ok = reader.strings(strings) &&
+            reader.integers(identifier) &&
+            reader.integers(type) &&
+            reader.integers(displayName) &&
+            reader.integers(description) &&
+            reader.integers(organization) &&
+            reader.integers(version) &&
+            reader.integers(verified) &&
+            reader.integers(removalDisallowed) &&
+            reader.integers(hash) &&
+            reader.integers(payloadsBegin) &&
+            reader.integers(payloadType) &&
+            reader.integers(payloadIdentifier) &&
+            reader.integers(payloadDisplayName) &&
+            reader.integers(payloadDescription) &&
+            reader.integers(payloadOrganization) &&
+            reader.integers(contentHash) &&
+            reader.integers(contentBegin) &&
+            reader.string(contentBlob) &&
+            reader.integers(byIdentifier);
+  if (!ok) {
+    return false;
+  }
+
+  // Check that everything refers to something that exists, so that nothing
+  // else has to.
+  const size_t profileCount = identifier.size();
+  const size_t payloadCount = payloadType.size();
+  if (strings.empty() || !strings[0].empty()) {
+    return false;
+  }
+
+  for (const auto* column : {&type, &displayName, &description, &organization, &version}) {
+    if (column->size() != profileCount) {
+      return false;
+    }
+  }
+  if (verified.size() != profileCount || removalDisallowed.size() != profileCount ||
+      hash.size() != profileCount || byIdentifier.size() != profileCount ||
+      payloadsBegin.size() != profileCount + 1) {
+    return false;
+  }
+
+  for (const auto* column : {&payloadIdentifier, &payloadDisplayName, &payloadDescription, &payloadOrganization}) {
+    if (column->size() != payloadCount) {
+      return false;
+    }
+  }
+  if (contentHash.size() != payloadCount || contentBegin.size() != payloadCount + 1) {
+    return false;
+  }
+
+  for (const auto* column : {&identifier, &type, &displayName, &description, &organization, &version,
+                             &payloadType, &payloadIdentifier, &payloadDisplayName, &payloadDescription,
+                             &payloadOrganization}) {
+    for (const auto id : *column) {
+      if (id >= strings.size()) {
+        return false;
+      }
+    }
+  }
+
+  if (payloadsBegin.front() != 0 || payloadsBegin.back() != payloadCount ||
+      !std::is_sorted(payloadsBegin.begin(), payloadsBegin.end())) {
+    return false;
+  }
+  if (contentBegin.front() != 0 || contentBegin.back() != contentBlob.size() ||
+      !std::is_sorted(contentBegin.begin(), contentBegin.end())) {
+    return false;
+  }
+  for (const auto profile : byIdentifier) {
+    if (profile >= profileCount) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+void ProfileColumnsBuilder::add(const PlistTree& profile) {
+  auto& c = columns_;
+  if (c.strings.empty()) {
+    intern("");
+  }
+
+  c.identifier.push_back(intern(childValue(profile, "ProfileIdentifier")));
+  c.type.push_back(intern(childValue(profile, "ProfileType")));
+  c.displayName.push_back(intern(childValue(profile, "ProfileDisplayName")));
+  c.description.push_back(intern(childValue(profile, "ProfileDescription")));
+  c.organization.push_back(intern(childValue(profile, "ProfileOrganization")));
+  c.version.push_back(intern(childValue(profile, "ProfileVersion")));
+  c.verified.push_back(childValue(profile, "ProfileVerificationState") == "verified");
+  c.removalDisallowed.push_back(childValue(profile, "ProfileRemovalDisallowed") == "true");
+  c.hash.push_back(hashTree(profile));
+
+  auto payloads = profile.get_child_optional("ProfileItems");
+  if (payloads) {
+    BinaryWriter writer(c.contentBlob);
+    for (const auto& it : *payloads) {
+      const auto& payload = it.second;
+      c.payloadType.push_back(intern(childValue(payload, "PayloadType")));
+      c.payloadIdentifier.push_back(intern(childValue(payload, "PayloadIdentifier")));
+      c.payloadDisplayName.push_back(intern(childValue(payload, "PayloadDisplayName")));
+      c.payloadDescription.push_back(intern(childValue(payload, "PayloadDescription")));
+      c.payloadOrganization.push_back(intern(childValue(payload, "PayloadOrganization")));
+
+      auto content = payload.get_child_optional("PayloadContent");
+      if (content) {
+        c.contentHash.push_back(hashTree(*content));
+        writer.tree(*content);
+      } else {
+        c.contentHash.push_back(0);
+      }
+      c.contentBegin.push_back(c.contentBlob.size());
+    }
+  }
+  c.payloadsBegin.push_back(static_cast<uint32_t>(c.payloadType.size()));
+}
+
+
+ProfileColumns ProfileColumnsBuilder::finish() {
+  auto& c = columns_;
+  if (c.strings.empty()) {
+    intern("");
+  }
+
+  c.byIdentifier.resize(c.profiles());
+  std::iota(c.byIdentifier.begin(), c.byIdentifier.end(), 0);
+  std::stable_sort(c.byIdentifier.begin(), c.byIdentifier.end(), [&c](uint32_t a, uint32_t b) {
+    return c.str(c.identifier[a]) < c.str(c.identifier[b]);
+  });
+
+  ids_.clear();
+  return std::move(columns_);
+}
+
+
+uint32_t ProfileColumnsBuilder::intern(const std::string& value) {
+  auto it = ids_.find(value);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+
+  const auto id = static_cast<uint32_t>(columns_.strings.size());
+  columns_.strings.push_back(value);
+  ids_.emplace(value, id);
+  return id;
+}
+
+
+uint64_t hashTree(const PlistTree& tree, uint64_t hash) {
+  auto mix = [&hash](const std::string& data, unsigned char terminator) {
+    for (const auto c : data) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    hash = (hash ^ terminator) * 1099511628211ULL;
+  };
+
+  mix(tree.data().value, 0x1E);
+  hash = (hash ^ static_cast<unsigned char>(tree.data().type)) * 1099511628211ULL;
+  for (const auto& it : tree) {
+    mix(it.first, 0x1F);
+    hash = hashTree(it.second, (hash ^ 0x02) * 1099511628211ULL);
+    hash = (hash ^ 0x03) * 1099511628211ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_io.h"
+#include "plist_tree.h"
+
+
+/*
+ * The parsed profiles of one scope, in a flat, struct-of-arrays form that only
+ * holds what the tables need.  Every string is interned, and fields refer to
+ * it by its index in `strings` (where 0 is always the empty string), so a
+ * value shared by many profiles or payloads - e.g. a payload type - is only
+ * stored once.  Each PayloadContent is kept encoded (see BinaryWriter) in one
+ * blob, and only decoded when it's rendered.
+ */
+struct ProfileColumns {
+  std::vector<std::string> strings;
+
+  // One element per profile.
+  std::vector<uint32_t> identifier;
+  std::vector<uint32_t> type;
+  std::vector<uint32_t> displayName;
+  std::vector<uint32_t> description;
+  std::vector<uint32_t> organization;
+  std::vector<uint32_t> version;
+  std::vector<unsigned char> verified;
+  std::vector<unsigned char> removalDisallowed;
+
+  // A hash of the profile's full contents (as far as it was parsed).
+  std::vector<uint64_t> hash;
+
+  // The payloads of profile `i` are [payloadsBegin[i], payloadsBegin[i + 1]).
+  std::vector<uint32_t> payloadsBegin{0};
+
+  // One element per payload.
+  std::vector<uint32_t> payloadType;
+  std::vector<uint32_t> payloadIdentifier;
+  std::vector<uint32_t> payloadDisplayName;
+  std::vector<uint32_t> payloadDescription;
+  std::vector<uint32_t> payloadOrganization;
+
+  // The hash of the payload's content, or 0 if it has none (or the content
+  // wasn't parsed).
+  std::vector<uint64_t> contentHash;
+
+  // The content of payload `i` is contentBlob[contentBegin[i], contentBegin[i + 1]).
+  std::vector<uint64_t> contentBegin{0};
+  std::string contentBlob;
+
+  // Profile indexes, sorted by identifier.
+  std::vector<uint32_t> byIdentifier;
+
+  size_t profiles() const {
+    return identifier.size();
+  }
+
+  const std::string& str(uint32_t id) const {
+    return strings[id];
+  }
+
+  /*
+   * Calls the given callback with the index of every profile with the given
+   * identifier.
+   */
+  template<typename Fn>
+  void forEachWithIdentifier(const std::string& wanted, Fn callback) const;
+
+  /*
+   * Decodes the content of the given payload into `tree`, returning false if
+   * it has none.
+   */
+  bool content(size_t payload, PlistTree& tree) const;
+
+  void serialize(BinaryWriter& writer) const;
+  bool deserialize(BinaryReader& reader);
+};
+
+
+/*
+ * This class builds ProfileColumns from parsed profiles, one at a time, so
+ * that each tree can be thrown away as soon as it has been added.
+ */
+class ProfileColumnsBuilder {
+ public:
+  void add(const PlistTree& profile);
+
+  // Returns the finished columns; the builder can't be used afterwards.
+  ProfileColumns finish();
+
+ private:
+  uint32_t intern(const std::string& value);
+
+  ProfileColumns columns_;
+  std::unordered_map<std::string, uint32_t> ids_;
+};
+
+
+/*
+ * This function computes a stable 64-bit hash (FNV-1a) of the given tree,
+ * covering every key, value and value type under it as well as its structure.
+ */
+uint64_t hashTree(const PlistTree& tree, uint64_t hash = 14695981039346656037ULL);
+
+
+template<typename Fn>
+void ProfileColumns::forEachWithIdentifier(const std::string& wanted, Fn callback) const {
+  auto lower = std::lower_bound(byIdentifier.begin(), byIdentifier.end(), wanted,
+                                [this](uint32_t profile, const std::string& value) {
+    return str(identifier[profile]) < value;
+  });
+  for (auto it = lower; it != byIdentifier.end() && str(identifier[*it]) == wanted; ++it) {
+    callback(static_cast<size_t>(*it));
+  }
+}
@@ -0,0 +1,146 @@
+#include "profile_snapshot.h"
+
+#include <cerrno>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace osquery;
+
+
+/*
+ * The snapshot format is a header followed by every scope, written with
+ * BinaryWriter:
+ *
+ *   header:  "OSQPROF" kFormatVersion, written-at (Unix seconds), scope count
+ *   scope:   name, status code, status message, detail, then the scope's
+ *            ProfileColumns (see ProfileColumns::serialize())
+ *
+ * Anything that doesn't match - e.g. a snapshot from an older version of the
+ * extension - is rejected rather than half-loaded.
+ */
+namespace {
+
+const char kMagic[] = "OSQPROF";
+const unsigned char kFormatVersion = 2;
+
+}  // namespace
+
+
+Status writeProfileSnapshot(const std::string& path, const std::vector<StoredScopeRef>& scopes) {
+  std::string out;
+  BinaryWriter writer(out);
+
+  out.append(kMagic, sizeof(kMagic) - 1);
+  out.push_back(static_cast<char>(kFormatVersion));
+  writer.varint(static_cast<uint64_t>(time(nullptr)));
+  writer.varint(scopes.size());
+
+  for (const auto& scope : scopes) {
+    writer.string(scope.scope);
+    writer.varint(static_cast<uint64_t>(scope.statusCode));
+    writer.string(scope.statusMessage);
+    writer.varint(static_cast<uint64_t>(scope.detail));
+    scope.columns->serialize(writer);
+  }
+
+  // The temporary file is only ever created afresh, so that a file or symlink
+  // planted at its path can't be written through.  One left behind by a crash
+  // is removed first; unlink() doesn't follow symlinks either.
+  const auto tempPath = path + ".tmp";
+  unlink(tempPath.c_str());
+  int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return Status(1, "couldn't create " + tempPath);
+  }
+
+  size_t written = 0;
+  while (written < out.size()) {
+    ssize_t n = write(fd, out.data() + written, out.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      unlink(tempPath.c_str());
+      return Status(1, "couldn't write " + tempPath);
+    }
+    written += static_cast<size_t>(n);
+  }
+
+  // Make sure the data is on disk before the rename makes it the snapshot.
+  if (fsync(fd) != 0) {
+    close(fd);
+    unlink(tempPath.c_str());
+    return Status(1, "couldn't sync " + tempPath);
+  }
+  close(fd);
+
+  if (rename(tempPath.c_str(), path.c_str()) != 0) {
+    unlink(tempPath.c_str());
+    return Status(1, "couldn't rename " + tempPath);
+  }
+  return Status(0, "OK");
+}
+
+
+Status readProfileSnapshot(const std::string& path, std::vector<StoredScope>& scopes, uint64_t& age) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return Status(1, "no snapshot at " + path);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return Status(1, "empty snapshot");
+  }
+
+  const auto size = static_cast<size_t>(st.st_size);
+  void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return Status(1, "couldn't map snapshot");
+  }
+
+  BinaryReader reader(static_cast<const char*>(mapped), size);
+  const char version = static_cast<char>(kFormatVersion);
+
+  uint64_t writtenAt = 0;
+  uint64_t count = 0;
+  bool ok = reader.bytes(kMagic, sizeof(kMagic) - 1) &&
+            reader.bytes(&version, 1) &&
+            reader.varint(writtenAt) &&
+            reader.varint(count);
+
+  std::vector<StoredScope> result;
+  for (uint64_t i = 0; ok && i < count; i++) {
+    StoredScope scope;
+    uint64_t code = 0;
+    uint64_t detail = 0;
+    ok = reader.string(scope.scope) &&
+         reader.varint(code) &&
+         reader.string(scope.statusMessage) &&
+         reader.varint(detail) &&
+         scope.columns.deserialize(reader);
+
+    scope.statusCode = static_cast<int>(code);
+    scope.detail = static_cast<int>(detail);
+    result.push_back(std::move(scope));
+  }
+  ok = ok && reader.done();
+
+  munmap(mapped, size);
+
+  if (!ok) {
+    return Status(1, "malformed snapshot");
+  }
+
+  const auto now = static_cast<uint64_t>(time(nullptr));
+  age = (now > writtenAt) ? now - writtenAt : 0;
+  scopes = std::move(result);
+  return Status(0, "OK");
+}
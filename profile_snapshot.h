@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <osquery/status.h>
+
+#include "profile_columns.h"
+
+
+/*
+ * The profiles collected for one scope, as stored in a snapshot.  A scope with
+ * an empty name stands for every scope that wasn't collected.
+ */
+struct StoredScope {
+  std::string scope;
+  int statusCode = 0;
+  std::string statusMessage;
+  int detail = 0;
+  ProfileColumns columns;
+};
+
+
+/*
+ * A scope to write to a snapshot.  Its profiles are serialized straight from
+ * the given columns, which must outlive the write, rather than being copied.
+ */
+struct StoredScopeRef {
+  std::string scope;
+  int statusCode = 0;
+  std::string statusMessage;
+  int detail = 0;
+  const ProfileColumns* columns = nullptr;
+};
+
+
+/*
+ * This function writes the given scopes to a compact binary snapshot at the
+ * given path.  The snapshot is written to a temporary file next to it first
+ * and renamed into place, so that readers never see a partial snapshot, and
+ * is only readable by the current user.
+ */
+osquery::Status writeProfileSnapshot(const std::string& path, const std::vector<StoredScopeRef>& scopes);
+
+
+/*
+ * This function reads a snapshot written by writeProfileSnapshot(), and
+ * returns how many seconds ago it was written in `age`.
+ */
+osquery::Status readProfileSnapshot(const std::string& path,
+                                    std::vector<StoredScope>& scopes,
+                                    uint64_t& age);
@@ -0,0 +1,284 @@
+/*
+ * Tests for ColumnFilter and likeMatches().  Since the filter drops rows
+ * before SQLite sees them, likeMatches() must agree with SQLite's own LIKE:
+ * it's compared with sqlite3 over hand-written and randomly generated
+ * patterns, including multi-byte UTF-8 and ASCII case folding.
+ *
+ * Usage: column_filter_test
+ */
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include "../column_filter.h"
+
+using namespace osquery;
+
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (false)
+
+
+/*
+ * Evaluates `value LIKE pattern` with SQLite.
+ */
+class SqliteLike {
+ public:
+  SqliteLike() {
+    sqlite3_open(":memory:", &db_);
+    sqlite3_prepare_v2(db_, "SELECT ?1 LIKE ?2", -1, &statement_, nullptr);
+  }
+
+  ~SqliteLike() {
+    sqlite3_finalize(statement_);
+    sqlite3_close(db_);
+  }
+
+  bool matches(const std::string& pattern, const std::string& value) {
+    sqlite3_reset(statement_);
+    sqlite3_bind_text(statement_, 1, value.data(), static_cast<int>(value.size()), SQLITE_TRANSIENT);
+    sqlite3_bind_text(statement_, 2, pattern.data(), static_cast<int>(pattern.size()), SQLITE_TRANSIENT);
+    sqlite3_step(statement_);
+    return sqlite3_column_int(statement_, 0) != 0;
+  }
+
+ private:
+  sqlite3* db_ = nullptr;
+  sqlite3_stmt* statement_ = nullptr;
+};
+
+
+bool agrees(SqliteLike& sqlite, const std::string& pattern, const std::string& value) {
+  const bool expected = sqlite.matches(pattern, value);
+  if (likeMatches(pattern, value) != expected) {
+    std::fprintf(stderr, "'%s' LIKE '%s': sqlite says %d\n", value.c_str(), pattern.c_str(), expected);
+    return false;
+  }
+  return true;
+}
+
+
+void testHandWritten(SqliteLike& sqlite) {
+  const std::vector<std::pair<std::string, std::string>> cases = {
+    {"com.apple.%", "com.apple.wifi.managed"},
+    {"com.apple.%", "com.example.wifi"},
+    {"%wifi%", "com.apple.wifi.managed"},
+    {"%WiFi%", "com.apple.wifi.managed"},
+    {"COM.APPLE.WIFI.MANAGED", "com.apple.wifi.managed"},
+    {"%", ""},
+    {"%%", "abc"},
+    {"", ""},
+    {"", "a"},
+    {"a%", "a"},
+    {"abc%", "ab"},
+    {"_", ""},
+    {"_", "a"},
+    {"__", "a"},
+    {"_", "\xc3\xa9"},
+    {"__", "\xc3\xa9"},
+    {"_", "\xf0\x9f\x98\x80"},
+    {"caf_", "caf\xc3\xa9"},
+    {"caf_%", "caf\xc3\xa9s"},
+    {"%\xc3\xa9", "caf\xc3\xa9"},
+    {"\xc3\x89", "\xc3\xa9"},
+    {"%a%b%c", "xaxbxcx"},
+    {"%a%b%c", "xaxbxc"},
+    {"a%a%a", "aaaa"},
+    {"%_a", "a"},
+    {"%_a", "\xf0\x9f\x98\x80" "a"},
+    {"1", "1"},
+    {"1%", "10"},
+  };
+  for (const auto& it : cases) {
+    CHECK(agrees(sqlite, it.first, it.second));
+  }
+}
+
+
+std::string randomText(std::mt19937& rng, const std::vector<std::string>& alphabet, size_t maxLength) {
+  std::string text;
+  const auto length = rng() % (maxLength + 1);
+  for (size_t i = 0; i < length; i++) {
+    text += alphabet[rng() % alphabet.size()];
+  }
+  return text;
+}
+
+
+void testRandom(SqliteLike& sqlite) {
+  // Letters in both cases, non-ASCII letters (which SQLite doesn't fold), and
+  // characters of every UTF-8 length.
+  const std::vector<std::string> values = {"a", "A", "b", "B", ".", "\xc3\xa9", "\xc3\x89", "\xe2\x82\xac", "\xf0\x9f\x98\x80"};
+  std::vector<std::string> patterns = values;
+  patterns.push_back("%");
+  patterns.push_back("%");
+  patterns.push_back("_");
+  patterns.push_back("_");
+
+  std::mt19937 rng(1);
+  for (int round = 0; round < 200000; round++) {
+    const auto pattern = randomText(rng, patterns, 6);
+    const auto value = randomText(rng, values, 8);
+    if (!agrees(sqlite, pattern, value)) {
+      failures++;
+      return;
+    }
+  }
+}
+
+
+/*
+ * Evaluates `column = expr` with SQLite, for an INTEGER column holding
+ * `value` and an expression given as text, the way osqueryd passes it.
+ */
+class SqliteIntegerEquals {
+ public:
+  SqliteIntegerEquals() {
+    sqlite3_open(":memory:", &db_);
+    sqlite3_exec(db_, "CREATE TABLE t (v INTEGER)", nullptr, nullptr, nullptr);
+  }
+
+  ~SqliteIntegerEquals() {
+    sqlite3_close(db_);
+  }
+
+  bool matches(const std::string& expr, long long value) {
+    sqlite3_stmt* insert = nullptr;
+    sqlite3_exec(db_, "DELETE FROM t", nullptr, nullptr, nullptr);
+    sqlite3_prepare_v2(db_, "INSERT INTO t VALUES (?1)", -1, &insert, nullptr);
+    sqlite3_bind_int64(insert, 1, value);
+    sqlite3_step(insert);
+    sqlite3_finalize(insert);
+
+    sqlite3_stmt* select = nullptr;
+    sqlite3_prepare_v2(db_, "SELECT count(*) FROM t WHERE v = ?1", -1, &select, nullptr);
+    sqlite3_bind_text(select, 1, expr.data(), static_cast<int>(expr.size()), SQLITE_TRANSIENT);
+    sqlite3_step(select);
+    const bool matched = sqlite3_column_int(select, 0) != 0;
+    sqlite3_finalize(select);
+    return matched;
+  }
+
+ private:
+  sqlite3* db_ = nullptr;
+};
+
+
+QueryContext makeContext(const std::vector<std::pair<std::string, std::pair<ConstraintOperator, std::string>>>& constraints) {
+  QueryContext context;
+  for (const auto& it : constraints) {
+    context.constraints[it.first].add(Constraint(it.second.first, it.second.second));
+  }
+  return context;
+}
+
+
+void testColumnFilter() {
+  // No constraints on a column match anything.
+  auto none = makeContext({});
+  ColumnFilter unconstrained(none, {"type"});
+  CHECK(unconstrained.matches("type", "anything"));
+  CHECK(unconstrained.matches("verified", 1));
+
+  // Several EQUALS values are any-of.
+  auto anyOf = makeContext({
+    {"type", {EQUALS, "com.apple.wifi.managed"}},
+    {"type", {EQUALS, "com.apple.vpn.managed"}},
+  });
+  ColumnFilter types(anyOf, {"type"});
+  CHECK(types.matches("type", "com.apple.wifi.managed"));
+  CHECK(types.matches("type", "com.apple.vpn.managed"));
+  CHECK(!types.matches("type", "com.apple.mdm"));
+  CHECK(types.matches("identifier", "com.apple.mdm"));
+
+  // A column that wasn't asked for isn't filtered on.
+  ColumnFilter other(anyOf, {"identifier"});
+  CHECK(other.matches("type", "com.apple.mdm"));
+
+  // Every LIKE pattern has to match, as well as one of the EQUALS values.
+  auto likes = makeContext({
+    {"identifier", {LIKE, "com.example.%"}},
+    {"identifier", {LIKE, "%.wifi"}},
+  });
+  ColumnFilter identifiers(likes, {"identifier"});
+  CHECK(identifiers.matches("identifier", "com.example.wifi"));
+  CHECK(identifiers.matches("identifier", "COM.EXAMPLE.WIFI"));
+  CHECK(!identifiers.matches("identifier", "com.example.vpn"));
+  CHECK(!identifiers.matches("identifier", "org.example.wifi"));
+
+  auto both = makeContext({
+    {"identifier", {EQUALS, "com.example.wifi"}},
+    {"identifier", {EQUALS, "com.example.vpn"}},
+    {"identifier", {LIKE, "%wifi"}},
+  });
+  ColumnFilter mixed(both, {"identifier"});
+  CHECK(mixed.matches("identifier", "com.example.wifi"));
+  CHECK(!mixed.matches("identifier", "com.example.vpn"));
+
+  // INTEGER columns: any-of, with anything that isn't a plain integer left to
+  // SQLite.
+  auto integers = makeContext({
+    {"verified", {EQUALS, "1"}},
+    {"verified", {EQUALS, "2"}},
+  });
+  ColumnFilter verified(integers, {"verified"});
+  CHECK(verified.matches("verified", 1LL));
+  CHECK(verified.matches("verified", 2LL));
+  CHECK(!verified.matches("verified", 0LL));
+
+  for (const auto* expr : {"1.0", "0x1", "", "true", "1e0"}) {
+    auto nonInteger = makeContext({{"verified", {EQUALS, expr}}});
+    ColumnFilter loose(nonInteger, {"verified"});
+    CHECK(loose.matches("verified", 0LL));
+    CHECK(loose.matches("verified", 1LL));
+  }
+
+  // The filter may be looser than SQLite, but never stricter.
+  SqliteIntegerEquals sqlite;
+  for (const auto* expr : {"0", "1", "-1", "01", "+1", " 1", "1 ", "1.0", "1.5", "0x1", "1e0", "", "true", "9999999999"}) {
+    auto context = makeContext({{"verified", {EQUALS, expr}}});
+    ColumnFilter filter(context, {"verified"});
+    for (const auto value : {0LL, 1LL, -1LL, 9999999999LL}) {
+      if (sqlite.matches(expr, value) && !filter.matches("verified", value)) {
+        std::fprintf(stderr, "%lld = '%s' matches in sqlite, but not in ColumnFilter\n", value, expr);
+        failures++;
+      }
+    }
+  }
+
+  auto integerLike = makeContext({{"verified", {LIKE, "1%"}}});
+  ColumnFilter verifiedLike(integerLike, {"verified"});
+  CHECK(verifiedLike.matches("verified", 1LL));
+  CHECK(verifiedLike.matches("verified", 10LL));
+  CHECK(!verifiedLike.matches("verified", 0LL));
+}
+
+}  // namespace
+
+
+int main() {
+  SqliteLike sqlite;
+  testHandWritten(sqlite);
+  testRandom(sqlite);
+  testColumnFilter();
+
+  if (failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("column_filter_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Tests for encodeJson(): untyped output is compared byte-for-byte with
+ * pt::write_json() over randomly generated trees, and typed output is checked
+ * against hand-written expectations.
+ *
+ * Usage: json_encoder_test
+ */
+
+#include <cstdio>
+#include <random>
+#include <sstream>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "../json_encoder.h"
+
+namespace pt = boost::property_tree;
+
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (false)
+
+
+std::string randomString(std::mt19937& rng) {
+  std::string value;
+  const auto length = rng() % 40;
+  for (size_t i = 0; i < length; i++) {
+    const auto kind = rng() % 10;
+    if (kind < 6) {
+      value += static_cast<char>('a' + rng() % 26);
+    } else if (kind < 9) {
+      // Control characters, and bytes that aren't valid UTF-8 on their own.
+      value += static_cast<char>(rng() % 256);
+    } else {
+      value += "\"/\\\n\t"[rng() % 5];
+    }
+  }
+  if (rng() % 5 == 0) {
+    value += std::string(100, 'x');
+  }
+  return value;
+}
+
+
+/*
+ * Builds the same random tree as both a PlistTree and a pt::ptree.  Arrays
+ * are nodes whose children all have empty keys, as they are in both.
+ */
+void buildRandom(std::mt19937& rng, int depth, PlistTree& tree, pt::ptree& reference) {
+  const auto kind = depth > 3 ? 0 : rng() % 3;
+  if (kind == 0) {
+    const auto value = randomString(rng);
+    tree.data().value = value;
+    reference.put_value(value);
+    return;
+  }
+
+  const auto count = rng() % 5;
+  for (size_t i = 0; i < count; i++) {
+    std::string key;
+    if (kind == 1) {
+      key = randomString(rng);
+      if (key.empty()) {
+        key = "k";
+      }
+    }
+
+    PlistTree child;
+    pt::ptree referenceChild;
+    buildRandom(rng, depth + 1, child, referenceChild);
+    tree.push_back(std::make_pair(key, child));
+    reference.push_back(std::make_pair(key, referenceChild));
+  }
+}
+
+
+void testMatchesWriteJson() {
+  std::mt19937 rng(1);
+
+  for (int round = 0; round < 20000; round++) {
+    PlistTree tree;
+    pt::ptree reference;
+    buildRandom(rng, 0, tree, reference);
+
+    // pt::write_json() throws on a top-level value; that case is tested below.
+    if (reference.empty() && !reference.data().empty()) {
+      continue;
+    }
+
+    std::ostringstream stream;
+    pt::write_json(stream, reference, false);
+    auto expected = stream.str();
+    if (!expected.empty() && expected.back() == '\n') {
+      expected.pop_back();
+    }
+
+    std::string actual;
+    encodeJson(tree, false, actual);
+    if (actual != expected) {
+      std::fprintf(stderr, "mismatch:\n  write_json: %s\n  encodeJson: %s\n", expected.c_str(), actual.c_str());
+      failures++;
+      return;
+    }
+  }
+}
+
+
+PlistTree& add(PlistTree& tree, const std::string& key, const std::string& value, PlistType type) {
+  auto& child = tree.push_back(std::make_pair(key, PlistTree()))->second;
+  child.data().value = value;
+  child.data().type = type;
+  return child;
+}
+
+
+std::string encoded(const PlistTree& tree, bool typed) {
+  std::string out;
+  encodeJson(tree, typed, out);
+  return out;
+}
+
+
+void testTopLevelValue() {
+  PlistTree tree;
+  tree.data().value = "QUJD";
+  tree.data().type = PlistType::DATA;
+  CHECK(encoded(tree, false) == "\"QUJD\"");
+  CHECK(encoded(tree, true) == "\"QUJD\"");
+
+  PlistTree empty;
+  CHECK(encoded(empty, false) == "{}");
+}
+
+
+void testTyped() {
+  PlistTree tree;
+  tree.data().type = PlistType::DICT;
+  add(tree, "n", "42", PlistType::INTEGER);
+  add(tree, "r", "-0.5e3", PlistType::REAL);
+  add(tree, "bad", "nan", PlistType::REAL);
+  add(tree, "d", "1467376496", PlistType::DATE);
+  add(tree, "t", "true", PlistType::BOOLEAN);
+  add(tree, "f", "false", PlistType::BOOLEAN);
+  add(tree, "s", "42", PlistType::STRING);
+  add(tree, "o", "", PlistType::DICT);
+  add(tree, "a", "", PlistType::ARRAY);
+  auto& list = add(tree, "l", "", PlistType::ARRAY);
+  add(list, "", "1", PlistType::INTEGER);
+  add(list, "", "x", PlistType::STRING);
+
+  CHECK(encoded(tree, true) ==
+        "{\"n\":42,\"r\":-0.5e3,\"bad\":\"nan\",\"d\":1467376496,\"t\":true,\"f\":false,"
+        "\"s\":\"42\",\"o\":{},\"a\":[],\"l\":[1,\"x\"]}");
+  CHECK(encoded(tree, false) ==
+        "{\"n\":\"42\",\"r\":\"-0.5e3\",\"bad\":\"nan\",\"d\":\"1467376496\",\"t\":\"true\",\"f\":\"false\","
+        "\"s\":\"42\",\"o\":\"\",\"a\":\"\",\"l\":[\"1\",\"x\"]}");
+
+  PlistTree array;
+  array.data().type = PlistType::ARRAY;
+  add(array, "", "a", PlistType::STRING);
+  CHECK(encoded(array, true) == "[\"a\"]");
+  CHECK(encoded(array, false) == "{\"\":\"a\"}");
+}
+
+
+void testAppends() {
+  PlistTree tree;
+  add(tree, "k", "v", PlistType::STRING);
+
+  std::string out = "prefix";
+  encodeJson(tree, false, out);
+  CHECK(out == "prefix{\"k\":\"v\"}");
+}
+
+}  // namespace
+
+
+int main() {
+  testMatchesWriteJson();
+  testTopLevelValue();
+  testTyped();
+  testAppends();
+
+  if (failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("json_encoder_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,442 @@
+/*
+ * Tests for streamProfiles(): its output is compared with a reference parse of
+ * the same document (with Boost's XML parser, converted the same way as
+ * osquery's parsePlistContent()), over hand-written and randomly generated
+ * plists, and skip paths are checked to drop exactly what they name.
+ *
+ * Usage: plist_stream_test
+ */
+
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "../plist_stream.h"
+
+namespace pt = boost::property_tree;
+
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (false)
+
+
+using Profiles = std::map<std::string, std::vector<PlistTree>>;
+
+
+/*
+ * Converts a plist value, parsed by Boost into an element named `element`
+ * with the given contents, into a tree node.
+ */
+bool convertReference(const std::string& element, const pt::ptree& value, PlistTree& node) {
+  auto& data = node.data();
+
+  if (element == "dict") {
+    data.type = PlistType::DICT;
+
+    std::string key;
+    bool haveKey = false;
+    for (const auto& it : value) {
+      if (it.first == "<xmlattr>" || it.first == "<xmlcomment>") {
+        continue;
+      }
+      if (!haveKey) {
+        if (it.first != "key") {
+          return false;
+        }
+        key = it.second.data();
+        haveKey = true;
+        continue;
+      }
+
+      auto& child = node.push_back(std::make_pair(key, PlistTree()))->second;
+      if (!convertReference(it.first, it.second, child)) {
+        return false;
+      }
+      haveKey = false;
+    }
+    return !haveKey;
+  } else if (element == "array") {
+    data.type = PlistType::ARRAY;
+    for (const auto& it : value) {
+      if (it.first == "<xmlcomment>") {
+        continue;
+      }
+      auto& child = node.push_back(std::make_pair(std::string(), PlistTree()))->second;
+      if (!convertReference(it.first, it.second, child)) {
+        return false;
+      }
+    }
+    return true;
+  } else if (element == "true" || element == "false") {
+    data.value = element;
+    data.type = PlistType::BOOLEAN;
+  } else if (element == "string") {
+    data.value = value.data();
+    data.type = PlistType::STRING;
+  } else if (element == "integer") {
+    data.value = value.data();
+    data.type = PlistType::INTEGER;
+  } else if (element == "real") {
+    data.value = value.data();
+    data.type = PlistType::REAL;
+  } else if (element == "date") {
+    struct tm tm = {};
+    std::istringstream in(value.data());
+    char sep;
+    in >> tm.tm_year >> sep >> tm.tm_mon >> sep >> tm.tm_mday >> sep
+       >> tm.tm_hour >> sep >> tm.tm_min >> sep >> tm.tm_sec;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    data.value = std::to_string(static_cast<long long>(timegm(&tm)));
+    data.type = PlistType::DATE;
+  } else if (element == "data") {
+    for (const auto c : value.data()) {
+      if (!isspace(static_cast<unsigned char>(c))) {
+        data.value += c;
+      }
+    }
+    data.type = PlistType::DATA;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+bool referenceParse(const std::string& xml, Profiles& profiles) {
+  pt::ptree document;
+  std::istringstream in(xml);
+  pt::read_xml(in, document);
+
+  PlistTree root;
+  if (!convertReference("dict", document.get_child("plist.dict"), root)) {
+    return false;
+  }
+  // The callback is only called for profiles, so scopes without any don't
+  // appear at all.
+  for (auto& it : root) {
+    for (auto& profile : it.second) {
+      if (profile.second.data().type == PlistType::DICT) {
+        profiles[it.first].push_back(profile.second);
+      }
+    }
+  }
+  return true;
+}
+
+
+bool streamParse(const std::string& xml, const std::set<std::string>& skipPaths, Profiles& profiles) {
+  auto status = streamProfiles(xml, skipPaths, [&profiles](const std::string& scope, PlistTree& profile) {
+    profiles[scope].push_back(std::move(profile));
+  });
+  return status.ok();
+}
+
+
+bool sameTree(const PlistTree& a, const PlistTree& b) {
+  if (a.data().value != b.data().value || a.data().type != b.data().type || a.size() != b.size()) {
+    return false;
+  }
+  for (auto i = a.begin(), j = b.begin(); i != a.end(); ++i, ++j) {
+    if (i->first != j->first || !sameTree(i->second, j->second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool sameProfiles(const Profiles& a, const Profiles& b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (const auto& it : a) {
+    auto other = b.find(it.first);
+    if (other == b.end() || other->second.size() != it.second.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < it.second.size(); i++) {
+      if (!sameTree(it.second[i], other->second[i])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+const char kHeader[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+    "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+    "<plist version=\"1.0\">\n";
+
+
+/*
+ * A hand-written document with every kind of value, entities, comments and
+ * empty elements.
+ */
+void testHandWritten() {
+  std::string xml = std::string(kHeader) +
+      "<dict>\n"
+      "\t<key>_computerlevel</key>\n"
+      "\t<array>\n"
+      "\t\t<dict>\n"
+      "\t\t\t<!-- a comment -->\n"
+      "\t\t\t<key>ProfileDisplayName</key>\n"
+      "\t\t\t<string>Wi-Fi &amp; VPN &lt;corp&gt; &quot;x&quot; &apos;y&apos; &#x41;&#66;&#233;&#x1F600;</string>\n"
+      "\t\t\t<key>ProfileIdentifier</key>\n"
+      "\t\t\t<string>com.example.wifi</string>\n"
+      "\t\t\t<key>ProfileInstallDate</key>\n"
+      "\t\t\t<date>2016-07-01T12:34:56Z</date>\n"
+      "\t\t\t<key>ProfileItems</key>\n"
+      "\t\t\t<array>\n"
+      "\t\t\t\t<dict>\n"
+      "\t\t\t\t\t<key>PayloadContent</key>\n"
+      "\t\t\t\t\t<dict>\n"
+      "\t\t\t\t\t\t<key>AutoJoin</key>\n"
+      "\t\t\t\t\t\t<true/>\n"
+      "\t\t\t\t\t\t<key>Hidden</key>\n"
+      "\t\t\t\t\t\t<false/>\n"
+      "\t\t\t\t\t\t<key>Priority</key>\n"
+      "\t\t\t\t\t\t<integer>-3</integer>\n"
+      "\t\t\t\t\t\t<key>Ratio</key>\n"
+      "\t\t\t\t\t\t<real>0.5</real>\n"
+      "\t\t\t\t\t\t<key>Certificate</key>\n"
+      "\t\t\t\t\t\t<data>\n"
+      "\t\t\t\t\t\tTUlJQ2R6Q0NB\n"
+      "\t\t\t\t\t\tZUdnQXdJQkFn\n"
+      "\t\t\t\t\t\t</data>\n"
+      "\t\t\t\t\t\t<key>Empty</key>\n"
+      "\t\t\t\t\t\t<string/>\n"
+      "\t\t\t\t\t\t<key>NoDict</key>\n"
+      "\t\t\t\t\t\t<dict/>\n"
+      "\t\t\t\t\t\t<key>NoArray</key>\n"
+      "\t\t\t\t\t\t<array/>\n"
+      "\t\t\t\t\t</dict>\n"
+      "\t\t\t\t\t<key>PayloadType</key>\n"
+      "\t\t\t\t\t<string>com.apple.wifi.managed</string>\n"
+      "\t\t\t\t</dict>\n"
+      "\t\t\t</array>\n"
+      "\t\t\t<key>ProfileRemovalDisallowed</key>\n"
+      "\t\t\t<true/>\n"
+      "\t\t</dict>\n"
+      "\t</array>\n"
+      "\t<key>bob</key>\n"
+      "\t<array/>\n"
+      "</dict>\n"
+      "</plist>\n";
+
+  Profiles expected;
+  Profiles actual;
+  CHECK(referenceParse(xml, expected));
+  CHECK(streamParse(xml, {}, actual));
+  CHECK(sameProfiles(expected, actual));
+
+  const auto& profile = actual["_computerlevel"].at(0);
+  CHECK(profile.get_child("ProfileDisplayName").data().value ==
+        "Wi-Fi & VPN <corp> \"x\" 'y' AB\xc3\xa9\xf0\x9f\x98\x80");
+  CHECK(profile.get_child("ProfileInstallDate").data().value == "1467376496");
+
+  const auto& content = profile.get_child("ProfileItems").begin()->second.get_child("PayloadContent");
+  CHECK(content.get_child("Certificate").data().value == "TUlJQ2R6Q0NBZUdnQXdJQkFn");
+  CHECK(content.get_child("Certificate").data().type == PlistType::DATA);
+  CHECK(content.get_child("AutoJoin").data().value == "true");
+  CHECK(content.get_child("Priority").data().type == PlistType::INTEGER);
+  CHECK(content.get_child("NoDict").data().type == PlistType::DICT);
+  CHECK(content.get_child("NoArray").data().type == PlistType::ARRAY);
+}
+
+
+std::string escape(const std::string& value) {
+  std::string result;
+  for (const auto c : value) {
+    switch (c) {
+    case '&': result += "&amp;"; break;
+    case '<': result += "&lt;"; break;
+    case '>': result += "&gt;"; break;
+    default: result += c;
+    }
+  }
+  return result;
+}
+
+
+std::string randomText(std::mt19937& rng) {
+  static const char kChars[] = "abcXYZ019 .-_&<>\"'";
+  std::string text;
+  const auto length = rng() % 12;
+  for (size_t i = 0; i < length; i++) {
+    text += kChars[rng() % (sizeof(kChars) - 1)];
+  }
+  if (rng() % 8 == 0) {
+    text += "\xc3\xa9";
+  }
+  return text;
+}
+
+
+void writeValue(std::mt19937& rng, int depth, std::string& xml) {
+  switch (depth > 3 ? rng() % 5 : rng() % 7) {
+  case 0:
+    xml += "<string>" + escape(randomText(rng)) + "</string>";
+    break;
+  case 1:
+    xml += "<integer>" + std::to_string(static_cast<int>(rng() % 2000) - 1000) + "</integer>";
+    break;
+  case 2:
+    xml += (rng() % 2) ? "<true/>" : "<false/>";
+    break;
+  case 3:
+    xml += "<real>" + std::to_string(rng() % 100) + ".25</real>";
+    break;
+  case 4:
+    xml += "<data>\n\tQUJD\n\tREVG\n\t</data>";
+    break;
+  case 5: {
+    xml += "<array>";
+    const auto count = rng() % 4;
+    for (size_t i = 0; i < count; i++) {
+      writeValue(rng, depth + 1, xml);
+    }
+    xml += "</array>";
+    break;
+  }
+  default: {
+    xml += "<dict>";
+    const auto count = rng() % 5;
+    for (size_t i = 0; i < count; i++) {
+      xml += "\n<key>" + escape(randomText(rng)) + "</key>";
+      writeValue(rng, depth + 1, xml);
+    }
+    xml += "</dict>";
+  }
+  }
+}
+
+
+/*
+ * Random documents, with random values nested in random profiles.
+ */
+void testRandom() {
+  std::mt19937 rng(1);
+
+  for (int round = 0; round < 2000; round++) {
+    std::string xml = std::string(kHeader) + "<dict>";
+    const auto scopes = rng() % 3;
+    for (size_t i = 0; i < scopes; i++) {
+      xml += "<key>user" + std::to_string(i) + "</key><array>";
+      const auto profiles = rng() % 3;
+      for (size_t j = 0; j < profiles; j++) {
+        xml += "<dict>";
+        const auto keys = rng() % 6;
+        for (size_t k = 0; k < keys; k++) {
+          xml += "<key>" + escape(randomText(rng)) + "</key>";
+          writeValue(rng, 0, xml);
+        }
+        xml += "</dict>";
+      }
+      xml += "</array>";
+    }
+    xml += "</dict></plist>";
+
+    Profiles expected;
+    Profiles actual;
+    CHECK(referenceParse(xml, expected));
+    CHECK(streamParse(xml, {}, actual));
+    if (!sameProfiles(expected, actual)) {
+      std::fprintf(stderr, "mismatch for:\n%s\n", xml.c_str());
+      failures++;
+      return;
+    }
+  }
+}
+
+
+/*
+ * Skip paths drop exactly the values they name, in every payload - including
+ * where the skipped key is the last one in its dictionary.
+ */
+void testSkipPaths() {
+  std::string xml = std::string(kHeader) +
+      "<dict><key>_computerlevel</key><array><dict>"
+      "<key>ProfileIdentifier</key><string>p</string>"
+      "<key>ProfileItems</key><array>"
+      "<dict><key>PayloadType</key><string>a</string>"
+      "<key>PayloadContent</key><dict><key>X</key><string>1</string></dict></dict>"
+      "<dict><key>PayloadType</key><string>b</string>"
+      "<key>PayloadContent</key><dict><key>X</key><string>2</string></dict></dict>"
+      "<dict><key>PayloadContent</key><string>3</string>"
+      "<key>PayloadType</key><string>c</string></dict>"
+      "</array>"
+      "<key>ProfileVersion</key><integer>1</integer>"
+      "</dict></array></dict></plist>";
+
+  Profiles skipContent;
+  CHECK(streamParse(xml, {"ProfileItems.PayloadContent"}, skipContent));
+  const auto& profile = skipContent["_computerlevel"].at(0);
+  const auto& items = profile.get_child("ProfileItems");
+  CHECK(items.size() == 3);
+  for (const auto& it : items) {
+    CHECK(it.second.find("PayloadContent") == it.second.not_found());
+    CHECK(it.second.find("PayloadType") != it.second.not_found());
+  }
+  CHECK(profile.get_child("ProfileVersion").data().value == "1");
+
+  Profiles skipItems;
+  CHECK(streamParse(xml, {"ProfileItems"}, skipItems));
+  const auto& bare = skipItems["_computerlevel"].at(0);
+  CHECK(bare.find("ProfileItems") == bare.not_found());
+  CHECK(bare.get_child("ProfileIdentifier").data().value == "p");
+  CHECK(bare.get_child("ProfileVersion").data().value == "1");
+
+  // Skipping nothing matches the reference.
+  Profiles expected;
+  Profiles actual;
+  CHECK(referenceParse(xml, expected));
+  CHECK(streamParse(xml, {}, actual));
+  CHECK(sameProfiles(expected, actual));
+}
+
+
+void testMalformed() {
+  Profiles profiles;
+  CHECK(!streamParse("", {}, profiles));
+  CHECK(!streamParse(std::string(kHeader) + "<dict><key>a</key><array><dict>", {}, profiles));
+  CHECK(!streamParse(std::string(kHeader) + "<dict><key>a</key><array><dict><string>x</string></dict></array></dict>",
+                     {}, profiles));
+  CHECK(!streamParse(std::string(kHeader) + "<dict><key>a</key><array><dict><key>k</key><bogus/></dict></array></dict>",
+                     {}, profiles));
+}
+
+}  // namespace
+
+
+int main() {
+  testHandWritten();
+  testRandom();
+  testSkipPaths();
+  testMalformed();
+
+  if (failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("plist_stream_test: all checks passed\n");
+  return 0;
+}
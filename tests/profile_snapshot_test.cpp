@@ -0,0 +1,350 @@
+/*
+ * Tests for the snapshot format: ProfileColumns and whole snapshots written by
+ * writeProfileSnapshot() are read back unchanged, and anything that doesn't
+ * match the format - a truncated or extended file, the wrong header, or
+ * columns that refer to things that don't exist - is rejected.
+ *
+ * Usage: profile_snapshot_test
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../profile_columns.h"
+#include "../profile_snapshot.h"
+
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                              \
+  do {                                                                \
+    if (!(condition)) {                                               \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (false)
+
+
+PlistTree& add(PlistTree& tree, const std::string& key, const std::string& value, PlistType type) {
+  auto& child = tree.push_back(std::make_pair(key, PlistTree()))->second;
+  child.data().value = value;
+  child.data().type = type;
+  return child;
+}
+
+
+/*
+ * Three profiles: one with two payloads that have content, one with no
+ * payloads, and one with a payload whose content wasn't parsed (or isn't
+ * there).
+ */
+ProfileColumns makeColumns(bool withContent) {
+  ProfileColumnsBuilder builder;
+
+  PlistTree wifi;
+  add(wifi, "ProfileIdentifier", "com.example.wifi", PlistType::STRING);
+  add(wifi, "ProfileDisplayName", "Wi-Fi", PlistType::STRING);
+  add(wifi, "ProfileVersion", "1", PlistType::INTEGER);
+  add(wifi, "ProfileVerificationState", "verified", PlistType::STRING);
+  add(wifi, "ProfileRemovalDisallowed", "true", PlistType::BOOLEAN);
+  auto& wifiItems = add(wifi, "ProfileItems", "", PlistType::ARRAY);
+  for (const auto* ssid : {"corp", "guest network"}) {
+    auto& item = add(wifiItems, "", "", PlistType::DICT);
+    add(item, "PayloadType", "com.apple.wifi.managed", PlistType::STRING);
+    add(item, "PayloadIdentifier", std::string("com.example.wifi.") + ssid, PlistType::STRING);
+    if (withContent) {
+      auto& content = add(item, "PayloadContent", "", PlistType::DICT);
+      add(content, "SSID_STR", ssid, PlistType::STRING);
+      add(content, "AutoJoin", "true", PlistType::BOOLEAN);
+      add(content, "Certificate", "TUlJQ2R6Q0NB", PlistType::DATA);
+    }
+  }
+  builder.add(wifi);
+
+  PlistTree bare;
+  add(bare, "ProfileIdentifier", "com.example.bare", PlistType::STRING);
+  builder.add(bare);
+
+  PlistTree vpn;
+  add(vpn, "ProfileIdentifier", "com.example.vpn", PlistType::STRING);
+  add(vpn, "ProfileOrganization", "Example", PlistType::STRING);
+  auto& vpnItems = add(vpn, "ProfileItems", "", PlistType::ARRAY);
+  auto& item = add(vpnItems, "", "", PlistType::DICT);
+  add(item, "PayloadType", "com.apple.vpn.managed", PlistType::STRING);
+  builder.add(vpn);
+
+  return builder.finish();
+}
+
+
+bool sameTree(const PlistTree& a, const PlistTree& b) {
+  if (a.data().value != b.data().value || a.data().type != b.data().type || a.size() != b.size()) {
+    return false;
+  }
+  for (auto i = a.begin(), j = b.begin(); i != a.end(); ++i, ++j) {
+    if (i->first != j->first || !sameTree(i->second, j->second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool sameColumns(const ProfileColumns& a, const ProfileColumns& b) {
+  if (a.strings != b.strings || a.identifier != b.identifier || a.type != b.type ||
+      a.displayName != b.displayName || a.description != b.description ||
+      a.organization != b.organization || a.version != b.version || a.verified != b.verified ||
+      a.removalDisallowed != b.removalDisallowed || a.hash != b.hash ||
+      a.payloadsBegin != b.payloadsBegin || a.payloadType != b.payloadType ||
+      a.payloadIdentifier != b.payloadIdentifier || a.payloadDisplayName != b.payloadDisplayName ||
+      a.payloadDescription != b.payloadDescription || a.payloadOrganization != b.payloadOrganization ||
+      a.contentHash != b.contentHash || a.contentBegin != b.contentBegin ||
+      a.contentBlob != b.contentBlob || a.byIdentifier != b.byIdentifier) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a.payloadType.size(); i++) {
+    PlistTree first;
+    PlistTree second;
+    if (a.content(i, first) != b.content(i, second) || !sameTree(first, second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+std::string serialized(const ProfileColumns& columns) {
+  std::string out;
+  BinaryWriter writer(out);
+  columns.serialize(writer);
+  return out;
+}
+
+
+bool deserializes(const std::string& data, ProfileColumns& columns) {
+  BinaryReader reader(data.data(), data.size());
+  return columns.deserialize(reader) && reader.done();
+}
+
+
+std::string readFile(const std::string& path) {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+
+void writeFile(const std::string& path, const std::string& data) {
+  std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+}
+
+
+bool readsBack(const std::string& path) {
+  std::vector<StoredScope> scopes;
+  uint64_t age = 0;
+  return readProfileSnapshot(path, scopes, age).ok();
+}
+
+
+void testColumnsRoundTrip() {
+  for (const bool withContent : {true, false}) {
+    const auto columns = makeColumns(withContent);
+    CHECK(columns.profiles() == 3);
+    CHECK(columns.payloadType.size() == 3);
+
+    ProfileColumns read;
+    CHECK(deserializes(serialized(columns), read));
+    CHECK(sameColumns(columns, read));
+
+    PlistTree content;
+    CHECK(read.content(0, content) == withContent);
+    CHECK(!read.content(2, content));
+    if (withContent) {
+      PlistTree second;
+      CHECK(read.content(1, second));
+      CHECK(second.get_child("SSID_STR").data().value == "guest network");
+      CHECK(second.get_child("AutoJoin").data().type == PlistType::BOOLEAN);
+    }
+  }
+
+  // A scope without any profiles.
+  ProfileColumns empty = ProfileColumnsBuilder().finish();
+  ProfileColumns read;
+  CHECK(deserializes(serialized(empty), read));
+  CHECK(read.profiles() == 0);
+}
+
+
+void testColumnsRejected() {
+  const auto columns = makeColumns(true);
+
+  // Every truncation, and trailing bytes.
+  const auto data = serialized(columns);
+  for (size_t length = 0; length < data.size(); length++) {
+    ProfileColumns read;
+    if (deserializes(data.substr(0, length), read)) {
+      std::fprintf(stderr, "columns truncated to %zu bytes were accepted\n", length);
+      failures++;
+      break;
+    }
+  }
+  ProfileColumns extended;
+  CHECK(!deserializes(data + '\0', extended));
+
+  // String ids that are out of range, in a per-profile and a per-payload column.
+  auto badProfileString = columns;
+  badProfileString.displayName[1] = static_cast<uint32_t>(columns.strings.size());
+  ProfileColumns read;
+  CHECK(!deserializes(serialized(badProfileString), read));
+
+  auto badPayloadString = columns;
+  badPayloadString.payloadType[2] = 1000000;
+  CHECK(!deserializes(serialized(badPayloadString), read));
+
+  // A first string that isn't the empty one.
+  auto badFirstString = columns;
+  badFirstString.strings[0] = "x";
+  CHECK(!deserializes(serialized(badFirstString), read));
+
+  // Offsets that go backwards, with the right first and last offsets.
+  CHECK((columns.payloadsBegin == std::vector<uint32_t>{0, 2, 2, 3}));
+  auto unsortedPayloads = columns;
+  unsortedPayloads.payloadsBegin = {0, 2, 1, 3};
+  CHECK(!deserializes(serialized(unsortedPayloads), read));
+
+  auto unsortedContent = columns;
+  CHECK(unsortedContent.contentBegin[1] < unsortedContent.contentBegin[2]);
+  std::swap(unsortedContent.contentBegin[1], unsortedContent.contentBegin[2]);
+  CHECK(!deserializes(serialized(unsortedContent), read));
+
+  // Offsets past the end.
+  auto pastEnd = columns;
+  pastEnd.contentBegin.back()++;
+  CHECK(!deserializes(serialized(pastEnd), read));
+
+  // Columns of the wrong length, and an index to a profile that doesn't exist.
+  auto shortColumn = columns;
+  shortColumn.hash.pop_back();
+  CHECK(!deserializes(serialized(shortColumn), read));
+
+  auto badIndex = columns;
+  badIndex.byIdentifier[0] = 3;
+  CHECK(!deserializes(serialized(badIndex), read));
+}
+
+
+void testSnapshotRoundTrip(const std::string& path) {
+  const auto withContent = makeColumns(true);
+  const auto withoutContent = makeColumns(false);
+  const auto empty = ProfileColumnsBuilder().finish();
+
+  std::vector<StoredScopeRef> written(3);
+  written[0].scope = "_computerlevel";
+  written[0].detail = 2;
+  written[0].columns = &withContent;
+  written[1].scope = "bob";
+  written[1].detail = 1;
+  written[1].columns = &withoutContent;
+  written[2].statusCode = 1;
+  written[2].statusMessage = "the user could not be found";
+  written[2].columns = &empty;
+  CHECK(writeProfileSnapshot(path, written).ok());
+
+  std::vector<StoredScope> scopes;
+  uint64_t age = 1000;
+  CHECK(readProfileSnapshot(path, scopes, age).ok());
+  CHECK(age <= 1);
+  CHECK(scopes.size() == written.size());
+  for (size_t i = 0; i < scopes.size() && i < written.size(); i++) {
+    CHECK(scopes[i].scope == written[i].scope);
+    CHECK(scopes[i].statusCode == written[i].statusCode);
+    CHECK(scopes[i].statusMessage == written[i].statusMessage);
+    CHECK(scopes[i].detail == written[i].detail);
+    CHECK(sameColumns(scopes[i].columns, *written[i].columns));
+  }
+
+  // The temporary file was renamed into place.
+  CHECK(access((path + ".tmp").c_str(), F_OK) != 0);
+}
+
+
+void testSnapshotRejected(const std::string& path) {
+  const auto columns = makeColumns(true);
+  std::vector<StoredScopeRef> written(1);
+  written[0].scope = "_computerlevel";
+  written[0].columns = &columns;
+  CHECK(writeProfileSnapshot(path, written).ok());
+  const auto data = readFile(path);
+  CHECK(readsBack(path));
+
+  const auto corruptPath = path + ".corrupt";
+
+  // Every truncation, including an empty file.
+  for (size_t length = 0; length < data.size(); length++) {
+    writeFile(corruptPath, data.substr(0, length));
+    if (readsBack(corruptPath)) {
+      std::fprintf(stderr, "snapshot truncated to %zu bytes was accepted\n", length);
+      failures++;
+      break;
+    }
+  }
+
+  writeFile(corruptPath, data + '\0');
+  CHECK(!readsBack(corruptPath));
+
+  // The magic is "OSQPROF", followed by the format version.
+  auto badMagic = data;
+  badMagic[0] = 'X';
+  writeFile(corruptPath, badMagic);
+  CHECK(!readsBack(corruptPath));
+
+  auto badVersion = data;
+  badVersion[7]++;
+  writeFile(corruptPath, badVersion);
+  CHECK(!readsBack(corruptPath));
+
+  CHECK(!readsBack(path + ".missing"));
+
+  // A failed read leaves the caller's scopes alone.
+  std::vector<StoredScope> scopes(2);
+  uint64_t age = 0;
+  CHECK(!readProfileSnapshot(corruptPath, scopes, age).ok());
+  CHECK(scopes.size() == 2);
+
+  unlink(corruptPath.c_str());
+}
+
+}  // namespace
+
+
+int main() {
+  char directory[] = "/tmp/profile_snapshot_test.XXXXXX";
+  if (mkdtemp(directory) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  const std::string path = std::string(directory) + "/snapshot";
+
+  testColumnsRoundTrip();
+  testColumnsRejected();
+  testSnapshotRoundTrip(path);
+  testSnapshotRejected(path);
+
+  unlink(path.c_str());
+  rmdir(directory);
+
+  if (failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("profile_snapshot_test: all checks passed\n");
+  return 0;
+}